@@ -9,6 +9,14 @@ import re
 import argparse
 from collections import defaultdict
 
+MODES = ['epoll', 'uring', 'multishot', 'uring-zc']
+
+def mode_order(label):
+    """Sort key for result labels: known modes first, ring profiles after."""
+    mode, _, profile = label.partition('/')
+    rank = MODES.index(mode) if mode in MODES else len(MODES)
+    return (rank, mode, profile)
+
 def parse_result_file(filepath):
     """Extract key metrics from a result file."""
     metrics = {}
@@ -32,6 +40,13 @@ def parse_result_file(filepath):
             if match:
                 metrics['throughput_mbit'] = float(match.group(1))
 
+            # Extract latency percentiles (us)
+            match = re.search(r'p50:\s+([\d.]+)\s+p90:\s+([\d.]+)\s+p99:\s+([\d.]+)\s+p99\.9:\s+([\d.]+)', content)
+            if match:
+                metrics['p50'] = float(match.group(1))
+                metrics['p99'] = float(match.group(3))
+                metrics['p999'] = float(match.group(4))
+
             # Extract errors
             match = re.search(r'Errors:\s+(\d+)', content)
             if match:
@@ -49,15 +64,18 @@ def parse_result_file(filepath):
 
 def parse_filename(filename):
     """Extract test parameters from filename."""
-    # Expected format: mode_tTHREADS_cCONNS_mMSGSIZE.txt
-    match = re.match(r'(\w+)_t(\d+)_c(\d+)_m(\d+)\.txt', filename)
+    # Expected format: mode[_pPROFILE]_tTHREADS_cCONNS_mMSGSIZE.txt
+    match = re.match(r'([\w-]+?)(?:_p(\w+))?_t(\d+)_c(\d+)_m(\d+)\.txt', filename)
     if match:
+        mode = match.group(1)
+        if match.group(2):
+            mode = f"{mode}/{match.group(2)}"
         return {
-            'mode': match.group(1),
-            'threads': int(match.group(2)),
-            'conns': int(match.group(3)),
-            'msgsize': int(match.group(4)),
-            'total_conns': int(match.group(2)) * int(match.group(3))
+            'mode': mode,
+            'threads': int(match.group(3)),
+            'conns': int(match.group(4)),
+            'msgsize': int(match.group(5)),
+            'total_conns': int(match.group(3)) * int(match.group(4))
         }
     return None
 
@@ -128,10 +146,7 @@ def print_comparison(results):
                                 if 'throughput_mb' in data), default=0)
 
             # Print results for each mode
-            for mode in ['epoll', 'uring', 'multishot']:
-                if mode not in modes_data:
-                    continue
-
+            for mode in sorted(modes_data, key=mode_order):
                 data = modes_data[mode]
                 msg_rate = data.get('msg_rate', 0)
                 throughput = data.get('throughput_mb', 0)
@@ -142,6 +157,8 @@ def print_comparison(results):
                 print(f"                   {format_bar(msg_rate, max_msg_rate)}")
                 print(f"    Throughput:    {throughput:>12,.2f} MB/s")
                 print(f"                   {format_bar(throughput, max_throughput)}")
+                if 'p99' in data:
+                    print(f"    Latency (us):  p50 {data['p50']:.1f}  p99 {data['p99']:.1f}  p99.9 {data['p999']:.1f}")
                 print(f"    Errors:        {errors:>12,}")
 
                 # Calculate improvement over epoll
@@ -164,27 +181,27 @@ def print_summary_table(results):
     print()
 
     # Header
-    print(f"{'Mode':<12} {'Config':<12} {'MsgSize':<10} {'Msg/s':<15} {'MB/s':<12} {'Errors':<10}")
+    print(f"{'Mode':<18} {'Config':<12} {'MsgSize':<10} {'Msg/s':<15} {'MB/s':<12} {'p99 us':<10} {'Errors':<10}")
     print("-" * 100)
 
     # Sort and print all results
     all_results = []
     for msgsize in sorted(results.keys()):
         for config in sorted(results[msgsize].keys()):
-            for mode in ['epoll', 'uring', 'multishot']:
-                if mode in results[msgsize][config]:
-                    data = results[msgsize][config][mode]
-                    all_results.append((
-                        mode,
-                        config,
-                        msgsize,
-                        data.get('msg_rate', 0),
-                        data.get('throughput_mb', 0),
-                        data.get('errors', 0)
-                    ))
-
-    for mode, config, msgsize, msg_rate, throughput, errors in sorted(all_results):
-        print(f"{mode:<12} {config:<12} {msgsize:<10} {msg_rate:>12,.2f}  {throughput:>9,.2f}  {errors:>9,}")
+            for mode, data in results[msgsize][config].items():
+                all_results.append((
+                    mode_order(mode),
+                    mode,
+                    config,
+                    msgsize,
+                    data.get('msg_rate', 0),
+                    data.get('throughput_mb', 0),
+                    data.get('p99', 0),
+                    data.get('errors', 0)
+                ))
+
+    for _, mode, config, msgsize, msg_rate, throughput, p99, errors in sorted(all_results):
+        print(f"{mode:<18} {config:<12} {msgsize:<10} {msg_rate:>12,.2f}  {throughput:>9,.2f}  {p99:>9,.1f}  {errors:>9,}")
 
     print("="*100)
 
@@ -210,13 +227,12 @@ def print_best_results(results):
                         'throughput': data.get('throughput_mb', 0)
                     }
 
-    for mode in ['epoll', 'uring', 'multishot']:
-        if mode in best:
-            data = best[mode]
-            print(f"{mode.upper()}")
-            print(f"  Best: {data['msg_rate']:,.2f} msg/s, {data['throughput']:.2f} MB/s")
-            print(f"  Config: {data['config']}, Message size: {data['msgsize']} bytes")
-            print()
+    for mode in sorted(best, key=mode_order):
+        data = best[mode]
+        print(f"{mode.upper()}")
+        print(f"  Best: {data['msg_rate']:,.2f} msg/s, {data['throughput']:.2f} MB/s")
+        print(f"  Config: {data['config']}, Message size: {data['msgsize']} bytes")
+        print()
 
     print("="*80)
 
@@ -6,6 +6,8 @@
 **
 */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <asm-generic/errno.h>
 #include <asm-generic/socket.h>
@@ -13,16 +15,28 @@
 #include <bits/time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <liburing.h>
 #include <liburing/io_uring.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -31,10 +45,38 @@
 #define BUFFER_SIZE 4096
 #define MAX_EVENTS 128
 #define SEC_NS 1000000000LL
+#define MAX_REACTORS 64
+#define BUSY_POLL_BUDGET 8
+#define CACHE_LINE 64
+#define SQ_IDLE_MS 1000
+#define FIXED_FILE_SLACK 256
+#define SIZE_CLASSES_MAX 3
+#define MAX_NUMA_NODES 64
+
+// Multishot buffer sizes with --size-classes.
+static const int size_classes[SIZE_CLASSES_MAX] = {512, 4096, 64 * 1024};
+
+/*
+**
+** epoll busy poll parameters (Linux 6.9), for headers that predate them.
+**
+*/
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t __pad;
+};
+
+#define EPOLL_IOC_TYPE 0x8A
+#define EPIOCSPARAMS _IOW(EPOLL_IOC_TYPE, 0x01, struct epoll_params)
+#endif
 
 /*
 **
-** Metrics recorded per benchmark.
+** Metrics recorded per benchmark. Every field is a counter summed over the
+** threads, see metrics_snapshot().
 **
 */
 typedef struct {
@@ -42,13 +84,147 @@ typedef struct {
   unsigned long long total_messages;
   unsigned long long connections_accepted;
   unsigned long long connections_closed;
-  struct timespec start_time;
-  struct timespec last_report_time;
+  unsigned long long zc_sends;
+  unsigned long long zc_copied;
+  unsigned long long copy_sends;
+  unsigned long long heap_allocs;
+  unsigned long long connections_rejected;
+  unsigned long long accept_errors;
+  unsigned long long uring_enters;
+  unsigned long long cqe_batches;
+  unsigned long long cqe_reaped;
+  unsigned long long epollout_waits;
+  unsigned long long read_pauses;
+  unsigned long long budget_yields;
+  unsigned long long ring_bytes_used;
+  unsigned long long enobufs;
+  unsigned long long ring_groups;
+  unsigned long long ring_buffers;
+  unsigned long long ring_buffer_bytes;
+  unsigned long long ring_buffers_busy;
+  unsigned long long ring_buffers_peak;
+  // Buffers out of the ring in the emptiest group, and that group's size.
+  unsigned long long ring_group_out_peak;
+  unsigned long long ring_group_out_size;
+  unsigned long long recv_rearms;
+  unsigned long long recv_starved;
+  unsigned long long class_recvs[SIZE_CLASSES_MAX];
+  unsigned long long class_bytes[SIZE_CLASSES_MAX];
+  unsigned long long class_switches;
+  unsigned long long bundle_recvs;
+  unsigned long long bundle_recv_bufs;
+  unsigned long long bundle_sends;
+  unsigned long long bundle_send_bufs;
+  unsigned long long arena_hugetlb_bytes;
+  unsigned long long arena_thp_bytes;
+  unsigned long long arena_plain_bytes;
+  unsigned long long numa_local;
+  unsigned long long numa_remote;
 } metrics_t;
 
-metrics_t metrics = {0};
+#define METRIC_FIELDS (sizeof(metrics_t) / sizeof(unsigned long long))
+
+/*
+**
+** Each thread counts into its own slot, padded to whole cache lines so the
+** reactors never write to a line another one owns. Only the owner writes a
+** slot, so an update is a plain load and store with no lock prefix. The
+** reporter thread reads every slot while they are being written, so both
+** sides use relaxed atomics to keep the compiler from tearing or caching
+** the values.
+**
+** seq is a seqlock over the slot. A reactor makes it odd while it handles
+** a batch of events and even again before it waits for the next one, see
+** metrics_begin() and metrics_end(). Counters bumped outside a batch are
+** still read whole, just not necessarily together with the others.
+**
+*/
+typedef struct {
+  unsigned long long seq;
+  metrics_t counters;
+} __attribute__((aligned(CACHE_LINE))) metrics_slot_t;
+
+// One slot per reactor plus one for the main thread.
+static metrics_slot_t metrics_slots[MAX_REACTORS + 1];
+static __thread metrics_slot_t *metrics_self = &metrics_slots[MAX_REACTORS];
+
 volatile sig_atomic_t running = 1;
 
+static inline unsigned long long metric_add(unsigned long long *field,
+                                            unsigned long long n) {
+  unsigned long long old = __atomic_load_n(field, __ATOMIC_RELAXED);
+  __atomic_store_n(field, old + n, __ATOMIC_RELAXED);
+  return old;
+}
+
+// Both return the value before the update.
+#define METRIC_ADD(field, n) metric_add(&metrics_self->counters.field, (n))
+#define METRIC_SUB(field, n)                                                   \
+  metric_add(&metrics_self->counters.field, -(unsigned long long)(n))
+
+// Per thread high-water marks, summed into an upper bound of the total.
+#define METRIC_MAX(field, value)                                               \
+  do {                                                                         \
+    unsigned long long v_ = (value);                                           \
+    if (v_ > metrics_self->counters.field) {                                   \
+      __atomic_store_n(&metrics_self->counters.field, v_, __ATOMIC_RELAXED);   \
+    }                                                                          \
+  } while (0)
+
+static inline void metrics_begin(void) {
+  unsigned long long seq = metrics_self->seq;
+  if (!(seq & 1)) {
+    __atomic_store_n(&metrics_self->seq, seq + 1, __ATOMIC_RELAXED);
+    // Orders the odd seq before the counter stores that follow.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+}
+
+static inline void metrics_end(void) {
+  unsigned long long seq = metrics_self->seq;
+  if (seq & 1) {
+    __atomic_store_n(&metrics_self->seq, seq + 1, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+**
+** Sums every slot into a consistent snapshot, retrying a slot whose owner
+** was in the middle of a batch or finished one while it was being copied.
+**
+*/
+static void metrics_snapshot(metrics_t *out) {
+  unsigned long long *sum = (unsigned long long *)out;
+  memset(out, 0, sizeof(*out));
+
+  for (int i = 0; i <= MAX_REACTORS; i++) {
+    metrics_slot_t *slot = &metrics_slots[i];
+    unsigned long long *field = (unsigned long long *)&slot->counters;
+    unsigned long long copy[METRIC_FIELDS];
+    unsigned long long seq;
+
+    for (;;) {
+      seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1) {
+        // The owner may be preempted mid-batch on this very CPU.
+        sched_yield();
+        continue;
+      }
+      for (size_t f = 0; f < METRIC_FIELDS; f++) {
+        copy[f] = __atomic_load_n(&field[f], __ATOMIC_RELAXED);
+      }
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+        break;
+      }
+    }
+
+    for (size_t f = 0; f < METRIC_FIELDS; f++) {
+      sum[f] += copy[f];
+    }
+  }
+}
+
 /*
 **
 ** Modes available for the server (epoll/uring/uring + multishot).
@@ -58,8 +234,36 @@ typedef enum {
   MODE_EPOLL,
   MODE_URING,
   MODE_URING_MULTISHOT,
+  MODE_URING_ZC,
 } server_mode_t;
 
+/*
+**
+** io_uring setup flag profiles, see uring_init().
+**
+*/
+typedef enum {
+  RING_PROFILE_DEFAULT,
+  RING_PROFILE_COOP,
+  RING_PROFILE_DEFER,
+} ring_profile_t;
+
+static const char *ring_profile_names[] = {"default", "coop", "defer"};
+
+/*
+**
+** How the uring mode overlaps a connection's recv and send, see
+** uring_chain_complete().
+**
+*/
+typedef enum {
+  CHAIN_NONE,
+  CHAIN_LINK,
+  CHAIN_DOUBLE,
+} chain_mode_t;
+
+static const char *chain_mode_names[] = {"none", "link", "double"};
+
 /*
 **
 ** Operations dispatched for io_uring (application defined).
@@ -82,8 +286,75 @@ typedef struct {
   char *buffer;
   size_t len;
   int buffer_id;
+  void *conn;
+  // When a send was queued, with --latency.
+  long long start_ns;
 } request_t;
 
+/*
+**
+** Server options, set once from the command line before reactors start.
+**
+*/
+typedef struct {
+  int direct_send;
+  int buf_ring_entries;
+  int buf_size;
+  int buf_inc;
+  int bundle;
+  int buf_mem_max_mb;
+  int size_classes;
+  int hugepages;
+  int latency;
+  const char *trace_file;
+  int trace_entries;
+  // Nodes the reactors are spread over, round-robin, with --numa.
+  int numa_nodes[MAX_NUMA_NODES];
+  int numa_count;
+  int incoming_cpu;
+  // CPUs the reactors are pinned to, round-robin, with --cpus.
+  int cpus[MAX_REACTORS];
+  int cpu_count;
+  int reuseport_cpu;
+  int zc_threshold;
+  int max_conns;
+  int fixed_files;
+  int fixed_buffers;
+  int shared_listener;
+  int busy_poll_usec;
+  int sqpoll;
+  int sq_idle_ms;
+  int sq_cpu;
+  ring_profile_t ring_profile;
+  chain_mode_t chain;
+} server_config_t;
+
+server_config_t config = {0};
+
+/*
+**
+** A reactor is one event loop running on its own thread with its own
+** listener (SO_REUSEPORT) and its own epoll or io_uring instance. With
+** --shared-listener the epoll reactors all watch one listener instead.
+**
+*/
+typedef struct {
+  int id;
+  server_mode_t mode;
+  int port;
+  int listen_fd;
+  // NUMA node and CPU the reactor is bound to, -1 when unbound.
+  int node;
+  int cpu;
+  pthread_t thread;
+  // Only written by the reactor's own thread, read once it has exited.
+  unsigned long long accepted;
+  // Accepted connections whose SO_INCOMING_CPU was read, and how many of
+  // those had their packets processed on the reactor's own CPU.
+  unsigned long long incoming_known;
+  unsigned long long incoming_local;
+} reactor_t;
+
 /*
 **
 ** Returns a timestamp timespec as nanoseconds.
@@ -105,662 +376,3896 @@ void sigint_handler(int sig) {
 
 /*
 **
-** Print metrics to stdout.
+** dTLB miss counters for the whole process, opened before the reactors start
+** so their threads inherit them. A thread's counts are folded into the
+** parent's when it exits, so they are read once the reactors have joined.
+** Kernel misses are left out when perf_event_paranoid doesn't allow them,
+** and most VMs expose no TLB events at all.
 **
 */
-void print_metrics(int force) {
-  struct timespec now;
-  clock_gettime(CLOCK_MONOTONIC, &now);
+static int tlb_fds[2] = {-1, -1};
+static const char *tlb_names[2] = {"loads", "stores"};
+static int tlb_errno;
+static int tlb_user_only;
 
-  long long elapsed_ns = get_ns(&now) - get_ns(&metrics.last_report_time);
-
-  if (!force && elapsed_ns < SEC_NS) {
-    return;
-  }
-
-  long long total_elapsed_ns = get_ns(&now) - get_ns(&metrics.start_time);
-  double total_elapsed_sec = total_elapsed_ns / 1e9;
-  // double interval_sec = elapsed_ns / 1e9;
+static int tlb_counter_open(int op, int exclude_kernel) {
+  struct perf_event_attr attr = {
+      .type = PERF_TYPE_HW_CACHE,
+      .size = sizeof(attr),
+      .config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+      .inherit = 1,
+      .exclude_kernel = exclude_kernel,
+      .exclude_hv = 1,
+  };
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
 
-  double total_throughput_mbps =
-      (metrics.total_bytes * 8.0) / (total_elapsed_sec * 1000000.0);
-  double total_msg_rate = metrics.total_messages / total_elapsed_sec;
+static void tlb_counters_open(void) {
+  const int ops[2] = {PERF_COUNT_HW_CACHE_OP_READ,
+                      PERF_COUNT_HW_CACHE_OP_WRITE};
 
-  printf("\r[%.1fs] Connections: %llu active, %llu total | "
-         "Messages: %llu (%.0f msg/s) | "
-         "Throughput: %.2f Mb/s (%.2f MB/s) | "
-         "Total: %.2f MB",
-         total_elapsed_sec,
-         metrics.connections_accepted - metrics.connections_closed,
-         metrics.connections_accepted, metrics.total_messages, total_msg_rate,
-         total_throughput_mbps, total_throughput_mbps / 8.0,
-         metrics.total_bytes / (1024.0 * 1024.0));
+  for (int i = 0; i < 2; i++) {
+    tlb_fds[i] = tlb_counter_open(ops[i], tlb_user_only);
+    if (tlb_fds[i] < 0 && errno == EACCES && !tlb_user_only) {
+      tlb_user_only = 1;
+      tlb_fds[i] = tlb_counter_open(ops[i], 1);
+    }
+    if (tlb_fds[i] < 0) {
+      tlb_errno = errno;
+    }
+  }
+}
 
-  fflush(stdout);
+static void print_tlb_counters(unsigned long long total_messages) {
+  if (tlb_fds[0] < 0 && tlb_fds[1] < 0) {
+    printf("\ndTLB misses: unavailable (perf_event_open: %s)",
+           strerror(tlb_errno));
+    return;
+  }
 
-  metrics.last_report_time = now;
+  printf("\ndTLB misses%s:", tlb_user_only ? " (user space)" : "");
+  for (int i = 0; i < 2; i++) {
+    unsigned long long count;
+    if (tlb_fds[i] >= 0 &&
+        read(tlb_fds[i], &count, sizeof(count)) == sizeof(count)) {
+      printf(" %llu %s (%.2f per message)", count, tlb_names[i],
+             total_messages ? (double)count / total_messages : 0.0);
+    }
+  }
 }
 
 /*
 **
-** Set socket to non blocking.
+** Server-side latency histograms, recorded with --latency.
 **
-*/
-int set_nonblocking(int fd) {
-  int flags = fcntl(fd, F_GETFL, 0);
-  if (flags == -1)
-    return -1;
-  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-}
-
-/*
+** Each reactor has one histogram per operation:
+** - recv -> send: from the wakeup that delivered the data to the echo's
+**   send being queued;
+** - send: from the send being queued to its completion, which includes the
+**   wait for the batch's submit. For epoll it is the send() call itself;
+** - accept: from the wakeup that delivered a new connection to its first
+**   recv being queued.
 **
-** Set socket option to TPC_NO_DELAY.
+** Buckets are log-linear like HDR histograms: exact below 16 ns, then 16
+** linear sub-buckets per power of two, so a percentile is off by at most
+** 1/16. Values are in nanoseconds and capped at 2^40 (about 18 minutes).
 **
 */
-void set_tcp_nodelay(int fd) {
-  int flag = 1;
-  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
-}
+typedef enum {
+  LATENCY_RECV_SEND,
+  LATENCY_SEND,
+  LATENCY_ACCEPT,
+  LATENCY_OPS,
+} latency_op_t;
 
-/*
-**
-** Create a listener on the port.
-**
-*/
-int create_listening_socket(int port) {
-  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (listen_fd < 0) {
-    perror("socket: couldn't create listener file descriptor");
-    return -1;
-  }
+static const char *latency_op_names[LATENCY_OPS] = {"recv -> send", "send",
+                                                    "accept"};
 
-  int opt = 1;
-  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS                                                        \
+  ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
 
-  struct sockaddr_in addr = {
-      .sin_family = AF_INET,
-      .sin_port = htons(port),
-      .sin_addr.s_addr = INADDR_ANY,
-  };
+typedef struct {
+  unsigned long long buckets[LATENCY_BUCKETS];
+  unsigned long long count;
+  unsigned long long max;
+} latency_hist_t;
 
-  // Bind to listener address.
-  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror("bind");
-    close(listen_fd);
-    return -1;
+// Written by each reactor, read by main once they have exited.
+static latency_hist_t latency_hists[MAX_REACTORS][LATENCY_OPS];
+static __thread latency_hist_t *latency_self;
+static __thread long long latency_wakeup_ns;
+
+static inline long long latency_now(void) {
+  if (!latency_self) {
+    return 0;
   }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return get_ns(&now);
+}
 
-  // Listen.
-  if (listen(listen_fd, 512) < 0) {
-    perror("listen");
-    close(listen_fd);
-    return -1;
+static inline int latency_bucket(unsigned long long ns) {
+  if (ns < LATENCY_SUB) {
+    return ns;
   }
+  if (ns >> LATENCY_MAX_BITS) {
+    ns = (1ULL << LATENCY_MAX_BITS) - 1;
+  }
+  int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+  return (shift + 1) * LATENCY_SUB + (int)((ns >> shift) - LATENCY_SUB);
+}
 
-  return listen_fd;
+// The highest value that lands in a bucket.
+static unsigned long long latency_bucket_max(int bucket) {
+  if (bucket < LATENCY_SUB) {
+    return bucket;
+  }
+  int shift = bucket / LATENCY_SUB - 1;
+  unsigned long long sub = bucket % LATENCY_SUB + LATENCY_SUB;
+  return ((sub + 1) << shift) - 1;
 }
 
-/*
-**
-** epoll based server.
-**
-*/
-typedef struct {
-  int fd;
-  char buffer[BUFFER_SIZE];
-  size_t bytes_read;
-} epoll_conn_t;
+static inline void latency_record(latency_op_t op, long long start_ns) {
+  if (!latency_self || !start_ns) {
+    return;
+  }
 
-void run_epoll_server(int port) {
-  int listen_fd = create_listening_socket(port);
-  if (listen_fd < 0) {
-    exit(1);
+  long long ns = latency_now() - start_ns;
+  latency_hist_t *hist = &latency_self[op];
+  hist->buckets[latency_bucket(ns)]++;
+  hist->count++;
+  if ((unsigned long long)ns > hist->max) {
+    hist->max = ns;
   }
+}
 
-  set_nonblocking(listen_fd);
+static unsigned long long latency_percentile(const latency_hist_t *hist,
+                                             double q) {
+  unsigned long long target = (unsigned long long)(q * hist->count + 0.5);
+  unsigned long long seen = 0;
+  if (target == 0) {
+    target = 1;
+  }
 
-  int epoll_fd = epoll_create1(0);
-  if (epoll_fd < 0) {
-    perror("epoll_create1");
-    exit(1);
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= target) {
+      unsigned long long value = latency_bucket_max(i);
+      return value < hist->max ? value : hist->max;
+    }
   }
+  return hist->max;
+}
 
-  struct epoll_event ev = {
-      .events = EPOLLIN,
-      .data.fd = listen_fd,
-  };
+static void print_latency_hist(const char *name, const latency_hist_t *hist) {
+  printf("\n  %-14s %10llu %9.1f %9.1f %9.1f %9.1f", name, hist->count,
+         latency_percentile(hist, 0.5) / 1e3,
+         latency_percentile(hist, 0.99) / 1e3,
+         latency_percentile(hist, 0.999) / 1e3, hist->max / 1e3);
+}
 
-  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+static void print_latency(void) {
+  printf("\nLatency (us):          count       p50       p99     p99.9       "
+         "max");
 
-  struct epoll_event events[MAX_EVENTS];
-  epoll_conn_t *connections[MAX_CONN] = {0};
+  for (int op = 0; op < LATENCY_OPS; op++) {
+    latency_hist_t total = {0};
+    int reactors = 0;
 
-  printf("EPOLL server listening on port %d\n", port);
+    for (int r = 0; r < MAX_REACTORS; r++) {
+      const latency_hist_t *hist = &latency_hists[r][op];
+      if (!hist->count) {
+        continue;
+      }
+      reactors++;
+      for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total.buckets[i] += hist->buckets[i];
+      }
+      total.count += hist->count;
+      if (hist->max > total.max) {
+        total.max = hist->max;
+      }
+    }
 
-  while (running) {
-    int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+    print_latency_hist(latency_op_names[op], &total);
 
-    for (int i = 0; i < nfds; i++) {
-      int fd = events[i].data.fd;
-      if (fd == listen_fd) {
-        // Accept new connections.
-        while (1) {
-          struct sockaddr_in client_addr;
-          socklen_t addr_len = sizeof(client_addr);
+    // Each reactor on its own, when there are several.
+    for (int r = 0; r < MAX_REACTORS && reactors > 1; r++) {
+      if (latency_hists[r][op].count) {
+        char name[32];
+        snprintf(name, sizeof(name), "  reactor %d", r);
+        print_latency_hist(name, &latency_hists[r][op]);
+      }
+    }
+  }
+}
 
-          int client_fd =
-              accept(listen_fd, (struct sockaddr *)&client_addr, &addr_len);
+/*
+**
+** Per-op tracer, enabled with --trace file.
+**
+** Each reactor appends fixed-size events to its own ring, an anonymous
+** mapping populated up front, so recording is a few stores: no locks, no
+** allocation, no page faults and no syscalls. The timestamp comes from the
+** vDSO clock. Once the ring is full the oldest events are overwritten, so
+** it holds the last --trace-entries events of each reactor. Main writes
+** the rings to the file after the reactors exit, see trace_decode.py.
+**
+** io_uring completions are recorded as they are reaped: op is the request
+** type, res the CQE result, bytes the length that was asked for (0 for a
+** multishot recv) and flags the low CQE flags. A send with res < bytes was
+** short, a recv with -ENOBUFS ran out of buffers. Wakeups and CQ overflows
+** get events of their own. An overflow carries no count: with
+** IORING_FEAT_NODROP the kernel holds completions back rather than drop
+** them, so cq.koverflow stays 0, and the CQ has just been drained when the
+** flag is seen.
+**
+*/
+#define TRACE_MAGIC "EBTRACE1"
+#define TRACE_ENTRIES (1 << 20)
 
-          if (client_fd < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-              perror("accept");
-            }
-            break;
-          }
+enum {
+  TRACE_WAKEUP = OP_WRITE + 1,
+  TRACE_CQ_OVERFLOW,
+};
 
-          set_nonblocking(client_fd);
-          set_tcp_nodelay(client_fd);
+typedef struct {
+  uint64_t ns;
+  int32_t fd;
+  int32_t res;
+  uint32_t bytes;
+  uint16_t flags;
+  uint8_t op;
+  uint8_t pad;
+} trace_event_t;
 
-          epoll_conn_t *conn = malloc(sizeof(epoll_conn_t));
-          conn->fd = client_fd;
-          conn->bytes_read = 0;
-          connections[client_fd] = conn;
+typedef struct {
+  trace_event_t *events;
+  uint64_t head;
+} trace_ring_t;
 
-          struct epoll_event ev = {
-              .events = EPOLLIN | EPOLLET,
-              .data.fd = client_fd,
-          };
-          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+// Written by each reactor, dumped by main once they have exited.
+static trace_ring_t trace_rings[MAX_REACTORS];
+static __thread trace_ring_t *trace_self;
 
-          metrics.connections_accepted++;
-        }
-      } else {
-        // Handle client I/O.
-        epoll_conn_t *conn = connections[fd];
-        if (!conn)
-          continue;
+static inline void trace_record(int op, int fd, int res, unsigned int bytes,
+                                unsigned int flags) {
+  trace_ring_t *ring = trace_self;
+  if (!ring) {
+    return;
+  }
 
-        if (events[i].events & EPOLLIN) {
-          while (1) {
-            ssize_t n = recv(fd, conn->buffer + conn->bytes_read,
-                             BUFFER_SIZE - conn->bytes_read, 0);
-
-            if (n > 0) {
-              conn->bytes_read += n;
-              metrics.total_bytes += n;
-
-              // Echo.
-              ssize_t sent = send(fd, conn->buffer, conn->bytes_read, 0);
-              if (sent > 0) {
-                metrics.total_messages++;
-                conn->bytes_read = 0;
-              }
-            } else if (n == 0) {
-              // connection closed, cleanup.
-              epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-              close(fd);
-              free(conn);
-              connections[fd] = NULL;
-              metrics.connections_closed++;
-              break;
-            } else {
-              if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-                close(fd);
-                free(conn);
-                connections[fd] = NULL;
-                metrics.connections_closed++;
-              }
-
-              break;
-            }
-          }
-        }
-      }
-    }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-    print_metrics(0);
-  }
+  trace_event_t *ev = &ring->events[ring->head++ & (config.trace_entries - 1)];
+  ev->ns = get_ns(&now);
+  ev->fd = fd;
+  ev->res = res;
+  ev->bytes = bytes;
+  ev->flags = flags;
+  ev->op = op;
+}
 
-  printf("\n");
-  print_metrics(1);
+static inline void trace_cqe(request_t *req, struct io_uring_cqe *cqe) {
+  trace_record(req->type, req->fd, cqe->res, req->len, cqe->flags & 0xffff);
+}
 
-  // Clean up.
-  for (int i = 0; i < MAX_CONN; i++) {
-    if (connections[i]) {
-      close(connections[i]->fd);
-      free(connections[i]);
-    }
+static void trace_open(int id) {
+  size_t size = sizeof(trace_event_t) * config.trace_entries;
+  void *events = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (events == MAP_FAILED) {
+    perror("mmap(trace)");
+    return;
   }
 
-  close(epoll_fd);
-  close(listen_fd);
+  trace_rings[id].events = events;
+  trace_self = &trace_rings[id];
 }
 
 /*
 **
-** io_uring (single shot).
+** File layout, in host byte order: the magic, the version, the number of
+** reactors, the entries per ring and the start time, then for each reactor
+** its id, its event count and its events, oldest first.
 **
 */
-void run_uring_server(int port) {
-  int listen_fd = create_listening_socket(port);
-  if (listen_fd < 0) {
-    exit(1);
-  }
-
-  struct io_uring ring;
-  struct io_uring_params params;
-  memset(&params, 0, sizeof(params));
-
-  if (io_uring_queue_init_params(256, &ring, &params) < 0) {
-    perror("io_uring_queue_init_params");
-    exit(1);
+static void trace_dump(int num_reactors, long long start_ns) {
+  FILE *f = fopen(config.trace_file, "wb");
+  if (!f) {
+    perror(config.trace_file);
+    return;
   }
 
-  printf("IO_URING server listening on port %d\n", port);
-
-  // Submit initial accept.
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-  request_t *req = malloc(sizeof(request_t));
-  req->type = OP_ACCEPT;
-  req->fd = listen_fd;
-  req->buffer = NULL;
-
-  io_uring_prep_accept(sqe, listen_fd, NULL, NULL, 0);
-  io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&ring);
-
-  while (running) {
-    // Completion queue.
-    struct io_uring_cqe *cqe;
-    int ret = io_uring_wait_cqe_timeout(
-        &ring, &cqe,
-        &(struct __kernel_timespec){.tv_sec = 0, .tv_nsec = 100000000});
+  uint32_t header[3] = {1, num_reactors, config.trace_entries};
+  uint64_t start = start_ns;
+  fwrite(TRACE_MAGIC, 1, 8, f);
+  fwrite(header, sizeof(header), 1, f);
+  fwrite(&start, sizeof(start), 1, f);
 
-    if (ret == -ETIME) {
-      print_metrics(0);
-      continue;
+  unsigned long long total = 0;
+  for (int i = 0; i < num_reactors; i++) {
+    trace_ring_t *ring = &trace_rings[i];
+    uint64_t count = ring->head;
+    uint64_t first = 0;
+    if (count > (uint64_t)config.trace_entries) {
+      first = count - config.trace_entries;
+      count = config.trace_entries;
+    }
+    if (!ring->events) {
+      count = 0;
     }
 
-    if (ret < 0) {
-      fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-ret));
-      break;
+    uint32_t hdr[2] = {i, count};
+    fwrite(hdr, sizeof(hdr), 1, f);
+    for (uint64_t n = 0; n < count; n++) {
+      fwrite(&ring->events[(first + n) & (config.trace_entries - 1)],
+             sizeof(trace_event_t), 1, f);
     }
+    total += count;
 
-    request_t *req = io_uring_cqe_get_data(cqe);
-    int res = cqe->res;
+    if (ring->events) {
+      munmap(ring->events, sizeof(trace_event_t) * config.trace_entries);
+    }
+  }
 
-    if (req->type == OP_ACCEPT) {
-      if (res >= 0) {
-        // Mark connection as accepted
-        int client_fd = res;
-        set_tcp_nodelay(client_fd);
-        metrics.connections_accepted++;
+  if (fclose(f) != 0) {
+    perror(config.trace_file);
+    return;
+  }
+  printf("Trace: %llu events written to %s\n", total, config.trace_file);
+}
 
-        // Submit read for the new connection.
-        sqe = io_uring_get_sqe(&ring);
+/*
+**
+** Print metrics to stdout. Only the reporter thread calls this while the
+** reactors run, and main once they have exited, so the report state needs
+** no locking.
+**
+*/
+static struct timespec metrics_start_time;
+static struct timespec metrics_last_time;
+static metrics_t metrics_last;
 
-        request_t *read_req = malloc(sizeof(request_t));
-        read_req->type = OP_READ;
-        read_req->fd = client_fd;
-        read_req->buffer = malloc(BUFFER_SIZE);
-        read_req->len = BUFFER_SIZE;
+void print_metrics(int force) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-        io_uring_prep_recv(sqe, client_fd, read_req->buffer, BUFFER_SIZE, 0);
-        io_uring_sqe_set_data(sqe, read_req);
+  metrics_t cur;
+  metrics_snapshot(&cur);
 
-        // Submit another accept for the next connection.
-        sqe = io_uring_get_sqe(&ring);
+  long long total_elapsed_ns = get_ns(&now) - get_ns(&metrics_start_time);
+  double total_elapsed_sec = total_elapsed_ns / 1e9;
+  double interval_sec = (get_ns(&now) - get_ns(&metrics_last_time)) / 1e9;
 
-        request_t *accept_req = malloc(sizeof(request_t));
-        accept_req->type = OP_ACCEPT;
-        accept_req->fd = listen_fd;
-        accept_req->buffer = NULL;
+  unsigned long long total_bytes = cur.total_bytes;
+  unsigned long long total_messages = cur.total_messages;
+  unsigned long long connections_accepted = cur.connections_accepted;
+  unsigned long long connections_closed = cur.connections_closed;
 
-        io_uring_prep_accept(sqe, listen_fd, NULL, NULL, 0);
-        io_uring_sqe_set_data(sqe, accept_req);
+  double total_throughput_mbps =
+      (total_bytes * 8.0) / (total_elapsed_sec * 1000000.0);
 
-        io_uring_submit(&ring);
-      }
-    } else if (req->type == OP_READ) {
-      if (res > 0) {
-        metrics.total_bytes += res;
-        metrics.total_messages++;
+  double total_msg_rate = total_messages / total_elapsed_sec;
 
-        // Echo.
-        sqe = io_uring_get_sqe(&ring);
-        request_t *write_req = malloc(sizeof(request_t));
-        write_req->type = OP_WRITE;
-        write_req->fd = req->fd;
-        write_req->buffer = req->buffer;
-        write_req->len = res;
+  // The last interval, next to the averages since the start.
+  double msg_rate = 0;
+  double throughput_mbps = 0;
+  if (interval_sec > 0) {
+    msg_rate = (total_messages - metrics_last.total_messages) / interval_sec;
+    throughput_mbps = (total_bytes - metrics_last.total_bytes) * 8.0 /
+                      (interval_sec * 1000000.0);
+  }
 
-        io_uring_prep_send(sqe, req->fd, write_req->buffer, res, 0);
-        io_uring_sqe_set_data(sqe, write_req);
-        io_uring_submit(&ring);
+  printf("\r[%.1fs] Connections: %llu active, %llu total | "
+         "Messages: %llu (%.0f msg/s, %.0f avg) | "
+         "Throughput: %.2f Mb/s (%.2f avg) | "
+         "Total: %.2f MB",
+         total_elapsed_sec, connections_accepted - connections_closed,
+         connections_accepted, total_messages, msg_rate, total_msg_rate,
+         throughput_mbps, total_throughput_mbps,
+         total_bytes / (1024.0 * 1024.0));
 
-        free(req);
-      } else {
-        // Connection closed or errored out, cleanup.
-        close(req->fd);
-        free(req->buffer);
-        free(req);
-        metrics.connections_closed++;
-      }
-    } else if (req->type == OP_WRITE) {
-      // After write completion, submit another read.
-      if (res > 0) {
-        sqe = io_uring_get_sqe(&ring);
-        request_t *read_req = malloc(sizeof(request_t));
-        read_req->type = OP_READ;
-        read_req->fd = req->fd;
-        read_req->buffer = req->buffer;
-        read_req->len = BUFFER_SIZE;
-
-        io_uring_prep_recv(sqe, req->fd, read_req->buffer, BUFFER_SIZE, 0);
-        io_uring_sqe_set_data(sqe, read_req);
-        io_uring_submit(&ring);
-      } else {
-        close(req->fd);
-        free(req->buffer);
-        metrics.connections_closed++;
+  unsigned long long ring_buffers = cur.ring_buffers;
+  if (ring_buffers) {
+    printf(" | Buffers: %.1f%% held",
+           cur.ring_buffers_busy * 100.0 / ring_buffers);
+  }
+
+  unsigned long long zc_sends = cur.zc_sends;
+  unsigned long long copy_sends = cur.copy_sends;
+  if (force && (zc_sends || copy_sends)) {
+    printf("\nSends: %llu zero-copy (%llu copied by the kernel), %llu regular",
+           zc_sends, cur.zc_copied, copy_sends);
+  }
+
+  if (force) {
+    unsigned long long heap_allocs = cur.heap_allocs;
+    printf("\nHeap allocations on the I/O path: %llu (%.3f per message)",
+           heap_allocs,
+           total_messages ? (double)heap_allocs / total_messages : 0.0);
+
+    unsigned long long enters = cur.uring_enters;
+    if (enters) {
+      printf("\nio_uring_enter calls: %llu (%.3f per message)", enters,
+             total_messages ? (double)enters / total_messages : 0.0);
+    }
+
+    unsigned long long batches = cur.cqe_batches;
+    if (batches) {
+      printf("\nCompletion batches: %llu (%.2f CQEs per batch, %.1f per MB)",
+             batches, (double)cur.cqe_reaped / batches,
+             total_bytes ? cur.cqe_reaped * 1048576.0 / total_bytes : 0.0);
+    }
+
+    unsigned long long epollout_waits = cur.epollout_waits;
+    if (epollout_waits) {
+      printf("\nSend backpressure: %llu EPOLLOUT waits, %llu read pauses",
+             epollout_waits, cur.read_pauses);
+    }
+
+    unsigned long long budget_yields = cur.budget_yields;
+    if (budget_yields) {
+      printf("\nRead budget exhausted: %llu times", budget_yields);
+    }
+
+    // Payload against the buffer ring memory the kernel handed out: a
+    // whole buffer per recv, or only the bytes used when incremental.
+    unsigned long long ring_bytes_used = cur.ring_bytes_used;
+    if (ring_bytes_used) {
+      printf("\nBuffer ring: %.1f%% efficiency (%.2f MB payload in %.2f MB of "
+             "buffers), %llu ENOBUFS",
+             total_bytes * 100.0 / ring_bytes_used,
+             total_bytes / (1024.0 * 1024.0),
+             ring_bytes_used / (1024.0 * 1024.0), cur.enobufs);
+    }
+
+    if (ring_buffers) {
+      printf("\nBuffer pool: %llu groups, %llu buffers (%.1f MB), peak %.1f%% "
+             "held, emptiest group %.1f%% out of its ring, %llu recv "
+             "re-arms, %llu waits for buffers",
+             cur.ring_groups, ring_buffers,
+             cur.ring_buffer_bytes / (1024.0 * 1024.0),
+             cur.ring_buffers_peak * 100.0 / ring_buffers,
+             cur.ring_group_out_size
+                 ? cur.ring_group_out_peak * 100.0 / cur.ring_group_out_size
+                 : 0.0,
+             cur.recv_rearms, cur.recv_starved);
+    }
+
+    unsigned long long bundle_recvs = cur.bundle_recvs;
+    if (bundle_recvs) {
+      printf("\nBundles: %llu recvs (%.2f buffers each), %llu sends (%.2f "
+             "buffers each)",
+             bundle_recvs, (double)cur.bundle_recv_bufs / bundle_recvs,
+             cur.bundle_sends,
+             cur.bundle_sends
+                 ? (double)cur.bundle_send_bufs / cur.bundle_sends
+                 : 0.0);
+    }
+
+    if (config.size_classes) {
+      printf("\nSize classes:");
+      for (int i = 0; i < SIZE_CLASSES_MAX; i++) {
+        unsigned long long recvs = cur.class_recvs[i];
+        printf(" %d B: %llu recvs (%.0f bytes each),", size_classes[i], recvs,
+               recvs ? (double)cur.class_bytes[i] / recvs : 0.0);
       }
+      printf(" %llu switches", cur.class_switches);
+    }
+
+    // CPU spent for the traffic served, the other side of busy polling's
+    // latency gain.
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+      double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+      double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+      printf("\nCPU: %.2fs user, %.2fs sys (%.0f%% of one core, %.2f us per "
+             "message)",
+             user, sys, (user + sys) * 100.0 / total_elapsed_sec,
+             total_messages ? (user + sys) * 1e6 / total_messages : 0.0);
+    }
+
+    print_tlb_counters(total_messages);
+
+    if (config.hugepages) {
+      printf("\nHuge pages: %.1f MB hugetlb, %.1f MB transparent (advised), "
+             "%.1f MB regular",
+             cur.arena_hugetlb_bytes / (1024.0 * 1024.0),
+             cur.arena_thp_bytes / (1024.0 * 1024.0),
+             cur.arena_plain_bytes / (1024.0 * 1024.0));
+    }
+
+    if (config.latency) {
+      print_latency();
+    }
 
-      free(req);
+    // Not available for direct descriptors (-f).
+    unsigned long long local = cur.numa_local;
+    unsigned long long remote = cur.numa_remote;
+    if (local + remote) {
+      printf("\nNUMA locality: %llu connections on the reactor's node, %llu "
+             "cross-node (%.1f%% local)",
+             local, remote, local * 100.0 / (local + remote));
     }
 
-    io_uring_cqe_seen(&ring, cqe);
-    print_metrics(0);
+    unsigned long long rejected = cur.connections_rejected;
+    if (rejected) {
+      printf("\nConnections rejected (pool full): %llu", rejected);
+    }
+
+    unsigned long long accept_errors = cur.accept_errors;
+    if (accept_errors) {
+      printf("\nAccept errors: %llu", accept_errors);
+    }
   }
 
-  printf("\n");
-  print_metrics(1);
+  fflush(stdout);
 
-  io_uring_queue_exit(&ring);
-  close(listen_fd);
+  metrics_last = cur;
+  metrics_last_time = now;
 }
 
 /*
 **
-** io_uring (multishot).
+** Prints the progress line once a second until shutdown.
 **
 */
+static void *reporter_main(void *arg) {
+  (void)arg;
 
-#define BUFFER_RING_SIZE 256
-#define BUFFER_GROUP_ID 1
+  while (running) {
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = 100000000};
+    struct timespec now;
+    nanosleep(&tick, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (running && get_ns(&now) - get_ns(&metrics_last_time) >= SEC_NS) {
+      print_metrics(0);
+    }
+  }
+
+  return NULL;
+}
 
 /*
 **
-** Buffer ring management API.
+** NUMA topology, read from sysfs so there is no libnuma dependency.
+**
+** With --numa every reactor is bound to a node. Its thread runs on the
+** node's CPUs and prefers the node's memory, so the buffers it allocates
+** and touches first land there. io_arena_alloc() also mbind()s its
+** mappings to the node. A machine without NUMA shows up as a single node
+** holding every CPU.
 **
 */
 typedef struct {
-  void *buf_base;
-  struct io_uring_buf_ring *br;
-  size_t buf_size;
-  int buf_count;
-} buffer_group_t;
+  int id;
+  cpu_set_t cpus;
+  char cpulist[256];
+} numa_node_t;
+
+static numa_node_t numa_nodes[MAX_NUMA_NODES];
+static int numa_num_nodes;
+
+// Node the current reactor thread is bound to, -1 when unbound.
+static __thread int numa_current_node = -1;
+
+static int read_sysfs(const char *path, char *buf, size_t size) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+
+  char *line = fgets(buf, size, f);
+  fclose(f);
+  if (!line) {
+    return -1;
+  }
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
 
 /*
 **
-** Creates and registers buffer ring, alternative to `provide_buffers`.
+** Parses a sysfs list such as "0-3,8-11", of CPUs or nodes, into a set.
 **
 */
-static buffer_group_t *create_buffer_ring(struct io_uring *ring, int bgid,
-                                          int buf_count, size_t buf_size) {
-  buffer_group_t *bg = calloc(1, sizeof(buffer_group_t));
-  if (!bg) {
-    return NULL;
+static int parse_cpulist(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0) {
+      return -1;
+    }
+
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return -1;
+      }
+    }
+
+    for (long i = first; i <= last && i < CPU_SETSIZE; i++) {
+      CPU_SET(i, set);
+    }
+
+    if (*end == ',') {
+      end++;
+    } else if (*end) {
+      return -1;
+    }
+    p = end;
   }
 
-  bg->buf_size = buf_size;
-  bg->buf_count = buf_count;
+  return 0;
+}
 
-  // Allocate contiguous buffer memory
-  size_t total_size = buf_size * buf_count;
-  if (posix_memalign(&bg->buf_base, 4096, total_size)) {
-    free(bg);
-    return NULL;
+static void numa_init(void) {
+  char buf[1024];
+  cpu_set_t online;
+
+  if (read_sysfs("/sys/devices/system/node/online", buf, sizeof(buf)) < 0 ||
+      parse_cpulist(buf, &online) < 0) {
+    numa_nodes[0].id = 0;
+    sched_getaffinity(0, sizeof(cpu_set_t), &numa_nodes[0].cpus);
+    snprintf(numa_nodes[0].cpulist, sizeof(numa_nodes[0].cpulist), "all");
+    numa_num_nodes = 1;
+    return;
   }
-  memset(bg->buf_base, 0, total_size);
 
-  // Allocate buffer ring structure
-  size_t ring_size = sizeof(struct io_uring_buf) * buf_count;
-  void *ring_mem;
-  if (posix_memalign(&ring_mem, 4096, ring_size)) {
-    free(bg->buf_base);
-    free(bg);
-    return NULL;
+  for (int n = 0; n < MAX_NUMA_NODES; n++) {
+    if (!CPU_ISSET(n, &online)) {
+      continue;
+    }
+
+    numa_node_t *node = &numa_nodes[numa_num_nodes++];
+    node->id = n;
+
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+    if (read_sysfs(path, node->cpulist, sizeof(node->cpulist)) < 0 ||
+        parse_cpulist(node->cpulist, &node->cpus) < 0) {
+      CPU_ZERO(&node->cpus);
+      node->cpulist[0] = '\0';
+    }
   }
-  memset(ring_mem, 0, ring_size);
+}
 
-  // Register buffer ring with io_uring
-  struct io_uring_buf_reg reg = {
-      .ring_addr = (unsigned long)ring_mem,
-      .ring_entries = buf_count,
-      .bgid = bgid,
-  };
+static numa_node_t *numa_node(int id) {
+  for (int i = 0; i < numa_num_nodes; i++) {
+    if (numa_nodes[i].id == id) {
+      return &numa_nodes[i];
+    }
+  }
+  return NULL;
+}
 
-  int ret = io_uring_register_buf_ring(ring, &reg, 0);
-  if (ret) {
-    fprintf(stderr, "Failed to register buffer ring: %s\n", strerror(-ret));
-    free(ring_mem);
-    free(bg->buf_base);
-    free(bg);
-    return NULL;
+static int numa_cpu_node(int cpu) {
+  for (int i = 0; i < numa_num_nodes; i++) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &numa_nodes[i].cpus)) {
+      return numa_nodes[i].id;
+    }
   }
+  return -1;
+}
 
-  bg->br = (struct io_uring_buf_ring *)ring_mem;
+/*
+**
+** The n-th CPU of a node, wrapping around.
+**
+*/
+static int numa_node_cpu(numa_node_t *node, int n) {
+  int count = CPU_COUNT(&node->cpus);
+  if (count == 0) {
+    return -1;
+  }
 
-  // Add all buffers to the ring
-  for (int i = 0; i < buf_count; i++) {
-    void *buf_addr = (char *)bg->buf_base + (i * buf_size);
-    io_uring_buf_ring_add(bg->br, buf_addr, buf_size, i,
-                          io_uring_buf_ring_mask(buf_count), i);
+  n %= count;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &node->cpus) && n-- == 0) {
+      return cpu;
+    }
   }
-  io_uring_buf_ring_advance(bg->br, buf_count);
+  return -1;
+}
 
-  return bg;
+/*
+**
+** Memory policies go through the raw syscalls. The node mask is a bitmap of
+** unsigned longs, and the kernel reads one bit less than maxnode says.
+**
+*/
+#define NUMA_MASK_LONGS (MAX_NUMA_NODES / (8 * sizeof(unsigned long)))
+
+static void numa_mask(int node, unsigned long *mask) {
+  memset(mask, 0, NUMA_MASK_LONGS * sizeof(unsigned long));
+  mask[node / (8 * sizeof(unsigned long))] |=
+      1UL << (node % (8 * sizeof(unsigned long)));
 }
 
-static void *get_buffer(buffer_group_t *bg, int buf_id) {
-  return (char *)bg->buf_base + (buf_id * bg->buf_size);
+static long numa_prefer(int node) {
+  unsigned long mask[NUMA_MASK_LONGS];
+  numa_mask(node, mask);
+  return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NUMA_NODES + 1);
 }
 
-static void return_buffer(buffer_group_t *bg, int buf_id) {
-  void *buf_addr = get_buffer(bg, buf_id);
-  io_uring_buf_ring_add(bg->br, buf_addr, bg->buf_size, buf_id,
-                        io_uring_buf_ring_mask(bg->buf_count), 0);
-  io_uring_buf_ring_advance(bg->br, 1);
+static long numa_bind_memory(void *mem, size_t size, int node) {
+  unsigned long mask[NUMA_MASK_LONGS];
+  numa_mask(node, mask);
+  return syscall(SYS_mbind, mem, size, MPOL_PREFERRED, mask,
+                 MAX_NUMA_NODES + 1, 0);
 }
 
-static void free_buffer_ring(struct io_uring *ring, buffer_group_t *bg,
-                             int bgid) {
-  if (!bg)
+/*
+**
+** Runs on the reactor's thread before it allocates anything. With --cpus
+** or --incoming-cpu the reactor owns a single CPU, otherwise it may run on
+** any CPU of its node.
+**
+*/
+static void reactor_bind(reactor_t *r) {
+  if (r->node < 0 && r->cpu < 0) {
     return;
-  io_uring_unregister_buf_ring(ring, bgid);
-  if (bg->br)
-    free(bg->br);
-  if (bg->buf_base)
-    free(bg->buf_base);
-  free(bg);
+  }
+
+  cpu_set_t cpus;
+  if (r->cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(r->cpu, &cpus);
+  } else {
+    cpus = numa_node(r->node)->cpus;
+  }
+
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+    perror("sched_setaffinity");
+  }
+
+  if (r->node >= 0) {
+    if (numa_prefer(r->node) < 0) {
+      perror("set_mempolicy");
+    }
+    numa_current_node = r->node;
+  }
 }
 
-void run_uring_multishot_server(int port) {
-  int listen_fd = create_listening_socket(port);
-  if (listen_fd < 0) {
-    exit(1);
+/*
+**
+** Counts whether a new connection's packets are processed on the reactor's
+** CPU and node, going by the CPU the socket last received on.
+**
+*/
+static void reactor_locality(reactor_t *r, int fd) {
+  int cpu;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 ||
+      cpu < 0) {
+    return;
+  }
+
+  r->incoming_known++;
+  if (cpu == r->cpu) {
+    r->incoming_local++;
+  }
+
+  if (r->node < 0) {
+    return;
+  }
+  if (numa_cpu_node(cpu) == r->node) {
+    METRIC_ADD(numa_local, 1);
+  } else {
+    METRIC_ADD(numa_remote, 1);
+  }
+}
+
+/*
+**
+** Each pass of a reactor loop opens a metrics batch once its wait returns
+** and publishes it in reactor_report(), before the next wait, so the
+** reporter thread never sees half of a batch. The wakeup is also where
+** --latency starts the clock for what the wait delivered.
+**
+*/
+static inline void reactor_wakeup(reactor_t *r) {
+  (void)r;
+  metrics_begin();
+  latency_wakeup_ns = latency_now();
+  trace_record(TRACE_WAKEUP, -1, 0, 0, 0);
+}
+
+static inline void reactor_report(reactor_t *r) {
+  (void)r;
+  metrics_end();
+}
+
+static inline void reactor_accepted(reactor_t *r, int fd) {
+  r->accepted++;
+  METRIC_ADD(connections_accepted, 1);
+
+  // Direct descriptors can't be queried.
+  if ((r->node >= 0 || r->cpu >= 0) && fd >= 0 &&
+      !(r->mode != MODE_EPOLL && config.fixed_files)) {
+    reactor_locality(r, fd);
+  }
+}
+
+/*
+**
+** Set socket to non blocking.
+**
+*/
+int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+**
+** Set socket option to TPC_NO_DELAY.
+**
+*/
+void set_tcp_nodelay(int fd) {
+  int flag = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+/*
+**
+** Busy poll the device queue for up to usec on blocking reads of the socket.
+** Going above net.core.busy_read needs CAP_NET_ADMIN, so a failure is only
+** reported once.
+**
+*/
+void set_busy_poll(int fd, int usec) {
+  static int warned;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0 &&
+      !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+    perror("setsockopt(SO_BUSY_POLL)");
+  }
+}
+
+/*
+**
+** Raise the open file limit to the hard limit, the default soft limit of
+** 1024 is far below what the epoll server can hold.
+**
+*/
+void raise_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+/*
+**
+** Create a listener on the port.
+**
+*/
+int create_listening_socket(int port) {
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("socket: couldn't create listener file descriptor");
+    return -1;
+  }
+
+  int opt = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = INADDR_ANY,
+  };
+
+  // Bind to listener address.
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    close(listen_fd);
+    return -1;
+  }
+
+  // Listen.
+  if (listen(listen_fd, SOMAXCONN) < 0) {
+    perror("listen");
+    close(listen_fd);
+    return -1;
+  }
+
+  return listen_fd;
+}
+
+/*
+**
+** Steers each new connection to the listener of the reactor pinned to the
+** CPU its SYN was processed on, so RX softirq, accept and the echo loop all
+** run on one core. The program returns an index into the SO_REUSEPORT
+** group, which is the order the listeners were created in. CPUs without a
+** reactor of their own are spread by CPU number, and the kernel falls back
+** to its hash when the program fails or returns an index that is too big.
+**
+** Attaching to any listener sets the program for the whole group.
+**
+*/
+static int attach_reuseport_cpu_prog(int listen_fd, const reactor_t *reactors,
+                                     int count) {
+  struct sock_filter code[2 * MAX_REACTORS + 3];
+  int len = 0;
+
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                             SKF_AD_OFF + SKF_AD_CPU);
+  for (int i = 0; i < count; i++) {
+    code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                               reactors[i].cpu, 0, 1);
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+  }
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+  struct sock_fprog prog = {.len = len, .filter = code};
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                 sizeof(prog)) < 0) {
+    perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+**
+** Memory for I/O buffers and connection tables, the large areas every echo
+** touches.
+**
+** With --hugepages they are mapped with MAP_HUGETLB, so thousands of
+** connections' buffers sit behind a few 2 MiB TLB entries instead of one
+** per 4 KiB page. Without reserved huge pages (vm.nr_hugepages) it falls
+** back to a 2 MiB aligned mapping advised for transparent huge pages, which
+** are plain pages if THP is disabled. Contents are not cleared.
+**
+*/
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static size_t io_arena_size(size_t size) {
+  return (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+}
+
+static void *io_arena_alloc(size_t size, size_t align) {
+  static int warned;
+
+  if (!config.hugepages) {
+    void *mem;
+    return posix_memalign(&mem, align, size) ? NULL : mem;
+  }
+
+  size = io_arena_size(size);
+  char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED) {
+    METRIC_ADD(arena_hugetlb_bytes, size);
+    if (numa_current_node >= 0) {
+      numa_bind_memory(mem, size, numa_current_node);
+    }
+    return mem;
+  }
+
+  if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+    fprintf(stderr, "No huge pages reserved (vm.nr_hugepages), falling back "
+                    "to transparent huge pages\n");
+  }
+
+  // Map an extra huge page to trim the mapping to a 2 MiB boundary.
+  char *map = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  mem = (char *)(((uintptr_t)map + HUGE_PAGE_SIZE - 1) &
+                 ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  if (mem > map) {
+    munmap(map, mem - map);
+  }
+  munmap(mem + size, map + HUGE_PAGE_SIZE - mem);
+
+  if (madvise(mem, size, MADV_HUGEPAGE) == 0) {
+    METRIC_ADD(arena_thp_bytes, size);
+  } else {
+    METRIC_ADD(arena_plain_bytes, size);
+  }
+  if (numa_current_node >= 0) {
+    numa_bind_memory(mem, size, numa_current_node);
+  }
+  return mem;
+}
+
+static void io_arena_free(void *mem, size_t size) {
+  if (!mem) {
+    return;
+  }
+
+  if (config.hugepages) {
+    munmap(mem, io_arena_size(size));
+  } else {
+    free(mem);
+  }
+}
+
+/*
+**
+** epoll based server.
+**
+** Echoes go straight out with send(). Whatever the socket doesn't take is
+** appended to a per-connection output queue and EPOLLOUT is armed until it
+** drains. Once the queue passes the high-water mark the connection stops
+** reading, so a slow peer gets backpressure through its own send window
+** instead of the server buffering without bound. Reading resumes when the
+** queue is empty.
+**
+** A connection gets at most EPOLL_READ_BUDGET recvs per visit. If it still
+** has input after that it goes on a ready list, which the loop works
+** through round-robin between epoll_wait() calls. Edge-triggered epoll
+** won't report that leftover input again, and one flooding peer can't
+** hold up the rest of the batch.
+**
+*/
+#define EPOLL_HIGH_WATER (64 * 1024)
+#define EPOLL_OUT_CAP (EPOLL_HIGH_WATER + BUFFER_SIZE)
+#define EPOLL_CHUNK_CONNS 1024
+#define EPOLL_READ_BUDGET 16
+
+typedef struct epoll_conn {
+  int fd;
+  // Output queue, allocated on first use; out[out_off, out_off + out_len)
+  // is still to be sent.
+  char *out;
+  size_t out_off;
+  size_t out_len;
+  int out_armed;
+  int read_paused;
+  int ready;
+  struct epoll_conn *ready_prev;
+  struct epoll_conn *ready_next;
+  struct epoll_conn *next_free;
+  char buffer[BUFFER_SIZE];
+} epoll_conn_t;
+
+/*
+**
+** Connection table for the epoll server.
+**
+** Connections are handed out from chunks of EPOLL_CHUNK_CONNS slots that are
+** allocated as the table grows and never move, so the epoll_event carries a
+** plain pointer to the connection and a lookup is a dereference. Free slots
+** are kept on a LIFO list threaded through the slots themselves.
+**
+*/
+typedef struct {
+  epoll_conn_t **chunks;
+  int num_chunks;
+  epoll_conn_t *free_list;
+  // Connections with input left over once their read budget ran out.
+  epoll_conn_t *ready_head;
+  epoll_conn_t *ready_tail;
+} epoll_table_t;
+
+static void epoll_ready_push(epoll_table_t *table, epoll_conn_t *conn) {
+  if (conn->ready) {
+    return;
+  }
+
+  conn->ready = 1;
+  conn->ready_next = NULL;
+  conn->ready_prev = table->ready_tail;
+  if (table->ready_tail) {
+    table->ready_tail->ready_next = conn;
+  } else {
+    table->ready_head = conn;
+  }
+  table->ready_tail = conn;
+}
+
+static void epoll_ready_remove(epoll_table_t *table, epoll_conn_t *conn) {
+  if (!conn->ready) {
+    return;
+  }
+
+  if (conn->ready_prev) {
+    conn->ready_prev->ready_next = conn->ready_next;
+  } else {
+    table->ready_head = conn->ready_next;
+  }
+  if (conn->ready_next) {
+    conn->ready_next->ready_prev = conn->ready_prev;
+  } else {
+    table->ready_tail = conn->ready_prev;
+  }
+  conn->ready = 0;
+}
+
+static int epoll_table_grow(epoll_table_t *table) {
+  epoll_conn_t **chunks =
+      realloc(table->chunks, sizeof(*chunks) * (table->num_chunks + 1));
+  if (!chunks) {
+    return -1;
+  }
+  table->chunks = chunks;
+
+  epoll_conn_t *chunk =
+      io_arena_alloc(sizeof(epoll_conn_t) * EPOLL_CHUNK_CONNS, CACHE_LINE);
+  if (!chunk) {
+    return -1;
+  }
+  METRIC_ADD(heap_allocs, 1);
+  table->chunks[table->num_chunks++] = chunk;
+
+  // Hand out low slots first.
+  for (int i = EPOLL_CHUNK_CONNS - 1; i >= 0; i--) {
+    chunk[i].fd = -1;
+    chunk[i].next_free = table->free_list;
+    table->free_list = &chunk[i];
+  }
+
+  return 0;
+}
+
+static epoll_conn_t *epoll_table_get(epoll_table_t *table, int fd) {
+  if (!table->free_list && epoll_table_grow(table) < 0) {
+    return NULL;
+  }
+
+  epoll_conn_t *conn = table->free_list;
+  table->free_list = conn->next_free;
+
+  // The buffer is overwritten by every recv, only the header needs a reset.
+  memset(conn, 0, offsetof(epoll_conn_t, buffer));
+  conn->fd = fd;
+  return conn;
+}
+
+static void epoll_table_put(epoll_table_t *table, epoll_conn_t *conn) {
+  epoll_ready_remove(table, conn);
+  free(conn->out);
+  conn->out = NULL;
+  conn->fd = -1;
+  conn->next_free = table->free_list;
+  table->free_list = conn;
+}
+
+static void epoll_table_destroy(epoll_table_t *table) {
+  for (int c = 0; c < table->num_chunks; c++) {
+    for (int i = 0; i < EPOLL_CHUNK_CONNS; i++) {
+      epoll_conn_t *conn = &table->chunks[c][i];
+      if (conn->fd >= 0) {
+        close(conn->fd);
+        free(conn->out);
+      }
+    }
+    io_arena_free(table->chunks[c], sizeof(epoll_conn_t) * EPOLL_CHUNK_CONNS);
+  }
+  free(table->chunks);
+}
+
+static void epoll_conn_close(int epoll_fd, epoll_table_t *table,
+                             epoll_conn_t *conn) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  epoll_table_put(table, conn);
+  METRIC_ADD(connections_closed, 1);
+}
+
+/*
+**
+** Arm or disarm EPOLLOUT, only touching the interest list on a change.
+**
+*/
+static void epoll_conn_watch(int epoll_fd, epoll_conn_t *conn, int out) {
+  if (conn->out_armed == out) {
+    return;
+  }
+
+  struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLET | (out ? EPOLLOUT : 0),
+      .data.ptr = conn,
+  };
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+  conn->out_armed = out;
+
+  if (out) {
+    METRIC_ADD(epollout_waits, 1);
+  }
+}
+
+static int epoll_conn_queue(epoll_conn_t *conn, const char *data,
+                            size_t len) {
+  if (!conn->out) {
+    conn->out = malloc(EPOLL_OUT_CAP);
+    if (!conn->out) {
+      return -1;
+    }
+    METRIC_ADD(heap_allocs, 1);
+  }
+
+  // Reads stop at the high-water mark, so after compaction there is always
+  // room for one more buffer.
+  if (conn->out_off + conn->out_len + len > EPOLL_OUT_CAP) {
+    memmove(conn->out, conn->out + conn->out_off, conn->out_len);
+    conn->out_off = 0;
+  }
+
+  memcpy(conn->out + conn->out_off + conn->out_len, data, len);
+  conn->out_len += len;
+  return 0;
+}
+
+/*
+**
+** Send as much of the output queue as the socket takes, returns -1 on a
+** send error.
+**
+*/
+static int epoll_conn_flush(epoll_conn_t *conn) {
+  while (conn->out_len) {
+    ssize_t sent =
+        send(conn->fd, conn->out + conn->out_off, conn->out_len, MSG_NOSIGNAL);
+    trace_record(OP_WRITE, conn->fd, sent < 0 ? -errno : sent, conn->out_len,
+                 0);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+
+    conn->out_off += sent;
+    conn->out_len -= sent;
+  }
+
+  conn->out_off = 0;
+  return 0;
+}
+
+/*
+**
+** Echo what the socket has, up to the read budget. Returns -1 once the
+** connection is closed.
+**
+*/
+static int epoll_conn_read(int epoll_fd, epoll_table_t *table,
+                           epoll_conn_t *conn) {
+  epoll_ready_remove(table, conn);
+
+  for (int budget = EPOLL_READ_BUDGET;; budget--) {
+    if (!budget) {
+      // Come back to it after everyone else in this round.
+      epoll_ready_push(table, conn);
+      METRIC_ADD(budget_yields, 1);
+      break;
+    }
+
+    if (conn->out_len >= EPOLL_HIGH_WATER) {
+      // Leave the rest in the socket until the peer reads its echoes.
+      conn->read_paused = 1;
+      METRIC_ADD(read_pauses, 1);
+      break;
+    }
+
+    ssize_t n = recv(conn->fd, conn->buffer, BUFFER_SIZE, 0);
+    if (n >= 0 || errno != EAGAIN) {
+      trace_record(OP_READ, conn->fd, n < 0 ? -errno : n, BUFFER_SIZE, 0);
+    }
+
+    if (n > 0) {
+      METRIC_ADD(total_bytes, n);
+      METRIC_ADD(total_messages, 1);
+
+      // Echo, queueing whatever the socket doesn't take. Once something is
+      // queued everything after it has to queue too, to keep the order.
+      size_t sent = 0;
+      if (!conn->out_len) {
+        latency_record(LATENCY_RECV_SEND, latency_wakeup_ns);
+        long long start_ns = latency_now();
+        ssize_t ret = send(conn->fd, conn->buffer, n, MSG_NOSIGNAL);
+        latency_record(LATENCY_SEND, start_ns);
+        trace_record(OP_WRITE, conn->fd, ret < 0 ? -errno : ret, n, 0);
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          epoll_conn_close(epoll_fd, table, conn);
+          return -1;
+        }
+        sent = ret > 0 ? ret : 0;
+      }
+
+      if (sent < (size_t)n &&
+          epoll_conn_queue(conn, conn->buffer + sent, n - sent) < 0) {
+        epoll_conn_close(epoll_fd, table, conn);
+        return -1;
+      }
+    } else if (n == 0) {
+      // connection closed, cleanup.
+      epoll_conn_close(epoll_fd, table, conn);
+      return -1;
+    } else {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        epoll_conn_close(epoll_fd, table, conn);
+        return -1;
+      }
+      break;
+    }
+  }
+
+  epoll_conn_watch(epoll_fd, conn, conn->out_len > 0);
+  return 0;
+}
+
+void run_epoll_server(reactor_t *r) {
+  int listen_fd = r->listen_fd;
+
+  set_nonblocking(listen_fd);
+
+  int epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+
+  // A shared listener sits in every reactor's epoll set, EPOLLEXCLUSIVE
+  // wakes one of them per incoming connection instead of all.
+  struct epoll_event ev = {
+      .events = EPOLLIN | (config.shared_listener ? EPOLLEXCLUSIVE : 0),
+      .data.ptr = NULL,
+  };
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+  // Let epoll_wait() busy poll the NAPI contexts of its sockets before it
+  // goes to sleep.
+  if (config.busy_poll_usec) {
+    struct epoll_params params = {
+        .busy_poll_usecs = config.busy_poll_usec,
+        .busy_poll_budget = BUSY_POLL_BUDGET,
+    };
+    if (ioctl(epoll_fd, EPIOCSPARAMS, &params) < 0 && r->id == 0) {
+      perror("ioctl(EPIOCSPARAMS)");
+    }
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  epoll_table_t table = {0};
+
+  if (r->id == 0) {
+    printf("EPOLL server listening on port %d\n", r->port);
+  }
+
+  while (running) {
+    // Don't sleep while connections still have input waiting.
+    int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS,
+                          table.ready_head ? 0 : 100);
+    reactor_wakeup(r);
+
+    for (int i = 0; i < nfds; i++) {
+      epoll_conn_t *conn = events[i].data.ptr;
+      if (!conn) {
+        // Accept new connections.
+        while (1) {
+          struct sockaddr_in client_addr;
+          socklen_t addr_len = sizeof(client_addr);
+
+          int client_fd =
+              accept(listen_fd, (struct sockaddr *)&client_addr, &addr_len);
+          if (client_fd >= 0 || errno != EAGAIN) {
+            trace_record(OP_ACCEPT, listen_fd,
+                         client_fd < 0 ? -errno : client_fd, 0, 0);
+          }
+
+          if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+              perror("accept");
+            }
+            break;
+          }
+
+          set_nonblocking(client_fd);
+          set_tcp_nodelay(client_fd);
+          if (config.busy_poll_usec) {
+            set_busy_poll(client_fd, config.busy_poll_usec);
+          }
+
+          conn = epoll_table_get(&table, client_fd);
+          if (!conn) {
+            close(client_fd);
+            reactor_accepted(r, -1);
+            METRIC_ADD(connections_rejected, 1);
+            METRIC_ADD(connections_closed, 1);
+            continue;
+          }
+
+          struct epoll_event ev = {
+              .events = EPOLLIN | EPOLLET,
+              .data.ptr = conn,
+          };
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+          latency_record(LATENCY_ACCEPT, latency_wakeup_ns);
+
+          reactor_accepted(r, client_fd);
+        }
+      } else {
+        // Handle client I/O.
+        uint32_t revents = events[i].events;
+        int readable = (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+
+        if (revents & EPOLLOUT) {
+          if (epoll_conn_flush(conn) < 0) {
+            epoll_conn_close(epoll_fd, &table, conn);
+            continue;
+          }
+
+          // Drained, pick up the input left in the socket while paused.
+          if (!conn->out_len && conn->read_paused) {
+            conn->read_paused = 0;
+            readable = 1;
+          }
+        }
+
+        if (readable && !conn->read_paused) {
+          epoll_conn_read(epoll_fd, &table, conn);
+        } else {
+          epoll_conn_watch(epoll_fd, conn, conn->out_len > 0);
+        }
+      }
+    }
+
+    // One round over the connections that ran out of budget, those still
+    // busy after it requeue themselves behind the round.
+    epoll_conn_t *last = table.ready_tail;
+    while (table.ready_head) {
+      epoll_conn_t *conn = table.ready_head;
+      int end_of_round = conn == last;
+      epoll_conn_read(epoll_fd, &table, conn);
+      if (end_of_round) {
+        break;
+      }
+    }
+
+    reactor_report(r);
+  }
+
+  // Clean up.
+  epoll_table_destroy(&table);
+
+  close(epoll_fd);
+  // A shared listener is closed by main once every reactor is done.
+  if (!config.shared_listener) {
+    close(listen_fd);
+  }
+}
+
+/*
+**
+** Ring setup shared by the io_uring servers.
+**
+** With --sqpoll a kernel thread polls the submission queue, so submitting
+** only needs io_uring_enter() when that thread has gone idle and asks to be
+** woken up. Each reactor gets its own SQ thread, pinned to --sq-cpu plus the
+** reactor id when a CPU is given.
+**
+** Without any flags the kernel runs completion task_work by interrupting the
+** reactor wherever it happens to be. The coop profile only runs it on the
+** next transition into the kernel, and the defer profile goes further: the
+** ring has a single issuer and task_work is queued until the reactor waits
+** for completions, which then get processed as one batch. TASKRUN_FLAG makes
+** the kernel flag pending work in the SQ ring so liburing enters to run it.
+**
+** cq_entries asks for a completion queue larger than the default, clamped
+** to the kernel's limit, when the caller can have more completions pending.
+**
+*/
+#define URING_ENTRIES 256
+
+static void uring_init(struct io_uring *ring, reactor_t *r,
+                       unsigned int cq_entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  if (cq_entries > 2 * URING_ENTRIES) {
+    params.flags |= IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = cq_entries;
+  }
+
+  if (config.sqpoll) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = config.sq_idle_ms;
+    if (config.sq_cpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = config.sq_cpu + r->id;
+    }
+  }
+
+  switch (config.ring_profile) {
+  case RING_PROFILE_DEFAULT:
+    break;
+  case RING_PROFILE_COOP:
+    params.flags |= IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    break;
+  case RING_PROFILE_DEFER:
+    params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+                    IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    break;
+  }
+
+  int ret = io_uring_queue_init_params(URING_ENTRIES, ring, &params);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring_queue_init_params: %s\n", strerror(-ret));
+    exit(1);
+  }
+
+  // NAPI busy polling of the sockets the ring waits on (Linux 6.9).
+  if (config.busy_poll_usec) {
+    struct io_uring_napi napi = {.busy_poll_to = config.busy_poll_usec};
+    ret = io_uring_register_napi(ring, &napi);
+    if (ret < 0 && r->id == 0) {
+      fprintf(stderr, "io_uring_register_napi: %s\n", strerror(-ret));
+    }
+  }
+}
+
+/*
+**
+** Submit and wait wrappers that keep count of the io_uring_enter() calls
+** liburing makes underneath: a submit enters the kernel when something is
+** queued and the SQ thread (if any) is asleep, or when the kernel flags
+** pending task_work or a CQ overflow; a wait only when no completion is
+** ready.
+**
+*/
+static int uring_submit(struct io_uring *ring) {
+  unsigned int sq_flags = IO_URING_READ_ONCE(*ring->sq.kflags);
+  int enter = 0;
+
+  if (io_uring_sq_ready(ring)) {
+    enter = !(ring->flags & IORING_SETUP_SQPOLL) ||
+            (sq_flags & IORING_SQ_NEED_WAKEUP);
+  }
+  if (sq_flags & (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN)) {
+    enter = 1;
+  }
+  if (sq_flags & IORING_SQ_CQ_OVERFLOW) {
+    trace_record(TRACE_CQ_OVERFLOW, -1, 0, 0, 0);
+  }
+
+  if (enter) {
+    METRIC_ADD(uring_enters, 1);
+  }
+  return io_uring_submit(ring);
+}
+
+static int uring_submit_and_wait(struct io_uring *ring,
+                                 struct io_uring_cqe **cqe) {
+  unsigned int sq_flags = IO_URING_READ_ONCE(*ring->sq.kflags);
+  int enter = !io_uring_cq_ready(ring);
+
+  if (io_uring_sq_ready(ring)) {
+    enter |= !(ring->flags & IORING_SETUP_SQPOLL) ||
+             (sq_flags & IORING_SQ_NEED_WAKEUP);
+  }
+  if (sq_flags & (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN)) {
+    enter = 1;
+  }
+  if (sq_flags & IORING_SQ_CQ_OVERFLOW) {
+    trace_record(TRACE_CQ_OVERFLOW, -1, 0, 0, 0);
+  }
+
+  if (enter) {
+    METRIC_ADD(uring_enters, 1);
+  }
+  return io_uring_submit_and_wait_timeout(
+      ring, cqe, 1,
+      &(struct __kernel_timespec){.tv_sec = 0, .tv_nsec = 100000000}, NULL);
+}
+
+/*
+**
+** The loops queue SQEs for a whole batch of completions before submitting,
+** which can outgrow the SQ ring. Flush it to the kernel when it fills up.
+**
+*/
+static struct io_uring_sqe *uring_get_sqe(struct io_uring *ring) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  while (!sqe) {
+    uring_submit(ring);
+    sqe = io_uring_get_sqe(ring);
+  }
+  return sqe;
+}
+
+static inline void uring_batch_done(struct io_uring *ring,
+                                    unsigned int count) {
+  io_uring_cq_advance(ring, count);
+  METRIC_ADD(cqe_batches, 1);
+  METRIC_ADD(cqe_reaped, count);
+}
+
+/*
+**
+** Helpers shared by the io_uring servers.
+**
+** With registered files (-f) accepted sockets are installed straight into a
+** sparse fixed file table by a multishot direct accept and never get a
+** regular descriptor. Connections then refer to their table slot, and every
+** SQE carries IOSQE_FIXED_FILE so the kernel skips the per-op fget/fput.
+**
+*/
+static void uring_setup_files(struct io_uring *ring, int listen_fd) {
+  if (!config.fixed_files) {
+    return;
+  }
+
+  // The table has some slack over the pool so that slots whose close is
+  // still in flight don't make the next accept fail with -ENFILE; accepts
+  // past the pool size land in a slot and get closed as rejected instead.
+  int ret = io_uring_register_files_sparse(ring, config.max_conns +
+                                                     FIXED_FILE_SLACK);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring_register_files_sparse: %s\n", strerror(-ret));
+    exit(1);
+  }
+
+  // Direct descriptors can't be handed to setsockopt(), but accepted sockets
+  // inherit TCP_NODELAY from the listener.
+  set_tcp_nodelay(listen_fd);
+}
+
+static inline void uring_sqe_set_file(struct io_uring_sqe *sqe) {
+  if (config.fixed_files) {
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+}
+
+static void uring_prep_accept(struct io_uring_sqe *sqe, int listen_fd,
+                              int multishot) {
+  if (config.fixed_files) {
+    io_uring_prep_multishot_accept_direct(sqe, listen_fd, NULL, NULL, 0);
+  } else if (multishot) {
+    io_uring_prep_multishot_accept(sqe, listen_fd, NULL, NULL, 0);
+  } else {
+    io_uring_prep_accept(sqe, listen_fd, NULL, NULL, 0);
+  }
+}
+
+/*
+**
+** Accept is multishot whenever registered files are in use, so it only has
+** to be re-armed once the kernel stops posting IORING_CQE_F_MORE.
+**
+*/
+static inline int uring_accept_done(struct io_uring_cqe *cqe, int multishot) {
+  if (multishot || config.fixed_files) {
+    return !(cqe->flags & IORING_CQE_F_MORE);
+  }
+  return 1;
+}
+
+static void uring_accepted(int fd) {
+  if (!config.fixed_files) {
+    set_tcp_nodelay(fd);
+  }
+}
+
+/*
+**
+** Close and shutdown of direct descriptors go through the ring, their
+** completions carry no user data.
+**
+*/
+static void uring_close(struct io_uring *ring, int fd) {
+  if (!config.fixed_files) {
+    close(fd);
+    return;
+  }
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  io_uring_prep_close_direct(sqe, fd);
+  io_uring_sqe_set_data(sqe, NULL);
+}
+
+static void uring_shutdown(struct io_uring *ring, int fd) {
+  if (!config.fixed_files) {
+    shutdown(fd, SHUT_RDWR);
+    return;
+  }
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  io_uring_prep_shutdown(sqe, fd, SHUT_RDWR);
+  uring_sqe_set_file(sqe);
+  io_uring_sqe_set_data(sqe, NULL);
+}
+
+/*
+**
+** Fixed-capacity pool of per-connection objects for the io_uring backends.
+**
+** Objects live in one cache-line aligned array, next to an arena holding one
+** I/O buffer slot per object. Requests are embedded in the objects, so
+** `user_data` always points into the array and the steady state echo never
+** calls into the allocator. Free slots are kept on a LIFO stack.
+**
+*/
+typedef struct {
+  char *objs;
+  size_t obj_size;
+  char *buffers;
+  size_t buf_size;
+  int capacity;
+  int *free_slots;
+  int free_count;
+} conn_pool_t;
+
+static int conn_pool_init(conn_pool_t *pool, size_t obj_size, int capacity,
+                          size_t buf_size) {
+  memset(pool, 0, sizeof(*pool));
+  pool->obj_size = (obj_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+  pool->buf_size = buf_size;
+  pool->capacity = capacity;
+
+  pool->objs = io_arena_alloc(pool->obj_size * capacity, CACHE_LINE);
+  if (!pool->objs) {
+    return -1;
+  }
+  memset(pool->objs, 0, pool->obj_size * capacity);
+
+  if (buf_size) {
+    pool->buffers = io_arena_alloc(buf_size * capacity, 4096);
+    if (!pool->buffers) {
+      io_arena_free(pool->objs, pool->obj_size * capacity);
+      return -1;
+    }
+  }
+
+  pool->free_slots = malloc(sizeof(int) * capacity);
+  if (!pool->free_slots) {
+    io_arena_free(pool->buffers, pool->buf_size * capacity);
+    io_arena_free(pool->objs, pool->obj_size * capacity);
+    return -1;
+  }
+
+  // Hand out low slots first.
+  for (int i = 0; i < capacity; i++) {
+    pool->free_slots[i] = capacity - 1 - i;
+  }
+  pool->free_count = capacity;
+
+  return 0;
+}
+
+static void conn_pool_destroy(conn_pool_t *pool) {
+  free(pool->free_slots);
+  io_arena_free(pool->buffers, pool->buf_size * pool->capacity);
+  io_arena_free(pool->objs, pool->obj_size * pool->capacity);
+}
+
+static inline int conn_pool_index(conn_pool_t *pool, void *obj) {
+  return ((char *)obj - pool->objs) / pool->obj_size;
+}
+
+static inline char *conn_pool_buffer(conn_pool_t *pool, void *obj) {
+  return pool->buffers + conn_pool_index(pool, obj) * pool->buf_size;
+}
+
+/*
+**
+** Returns a zeroed object, or NULL once every slot is in use.
+**
+*/
+static void *conn_pool_get(conn_pool_t *pool) {
+  if (pool->free_count == 0) {
+    return NULL;
+  }
+
+  void *obj = pool->objs + pool->free_slots[--pool->free_count] * pool->obj_size;
+  memset(obj, 0, pool->obj_size);
+  return obj;
+}
+
+static void conn_pool_put(conn_pool_t *pool, void *obj) {
+  pool->free_slots[pool->free_count++] = conn_pool_index(pool, obj);
+}
+
+/*
+**
+** io_uring (single shot).
+**
+*/
+typedef struct {
+  int fd;
+  request_t recv_req;
+  request_t send_req;
+  char *buffer;
+  // --chain state: the two buffers of double, the buffer each op in flight
+  // uses (-1 for none), a received buffer waiting for the send in flight,
+  // and whether the recv has ended or a send failed.
+  char *buffers[2];
+  int recv_buf;
+  int send_buf;
+  int pending_buf;
+  unsigned int pending_len;
+  int recv_done;
+  int send_failed;
+} uring_conn_t;
+
+/*
+**
+** With registered buffers (-r) the whole pool arena is registered as buffer
+** index 0, so the kernel pins and maps its pages once at startup instead of
+** on every request. There is no fixed-buffer recv, and a plain send
+** flagged with IORING_RECVSEND_FIXED_BUF is only accepted by recent kernels
+** (older ones fail it with -EINVAL), so the echo uses READ_FIXED and
+** WRITE_FIXED, which behave like recv and send on a stream socket.
+**
+*/
+static void uring_register_arena(struct io_uring *ring, conn_pool_t *pool) {
+  struct iovec iov = {
+      .iov_base = pool->buffers,
+      .iov_len = pool->buf_size * pool->capacity,
+  };
+
+  int ret = io_uring_register_buffers(ring, &iov, 1);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring_register_buffers: %s\n", strerror(-ret));
+    exit(1);
+  }
+}
+
+static void uring_conn_recv(struct io_uring *ring, uring_conn_t *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (config.fixed_buffers) {
+    io_uring_prep_read_fixed(sqe, conn->fd, conn->buffer, BUFFER_SIZE, 0, 0);
+  } else {
+    io_uring_prep_recv(sqe, conn->fd, conn->buffer, BUFFER_SIZE, 0);
+  }
+  uring_sqe_set_file(sqe);
+  io_uring_sqe_set_data(sqe, &conn->recv_req);
+}
+
+static struct io_uring_sqe *uring_conn_send(struct io_uring *ring,
+                                            uring_conn_t *conn) {
+  request_t *req = &conn->send_req;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (config.fixed_buffers) {
+    io_uring_prep_write_fixed(sqe, conn->fd, req->buffer, req->len, 0, 0);
+  } else {
+    io_uring_prep_send(sqe, conn->fd, req->buffer, req->len, 0);
+  }
+  uring_sqe_set_file(sqe);
+  io_uring_sqe_set_data(sqe, req);
+  req->start_ns = latency_now();
+  return sqe;
+}
+
+/*
+**
+** Recv and send overlap for the uring mode (--chain).
+**
+** By default the reactor takes two trips per echo: the recv completion
+** queues the send, and the send completion queues the next recv.
+**
+** link queues the send and the next recv together, linked with
+** IOSQE_IO_LINK, so the kernel starts the recv as soon as the send is done.
+** The send uses MSG_WAITALL, so it only completes short on an error, and
+** that breaks the link and cancels the recv. Where the kernel supports it
+** the send is flagged IOSQE_CQE_SKIP_SUCCESS and only posts on failure,
+** leaving one completion per echo, unless --latency needs its completion
+** to time it. The pair is queued with room for both SQEs, as a flush
+** between them would break the link. The recv always completes last, so the
+** connection is closed once it has ended and a failed send, if any, has
+** been reaped.
+**
+** double gives the connection two buffers and keeps a recv posted in one
+** while the other is being sent. A second message arriving before the
+** send completes waits as pending, and sends stay one at a time so the
+** echo keeps its order.
+**
+*/
+static void uring_chain_close(struct io_uring *ring, conn_pool_t *pool,
+                              uring_conn_t *conn) {
+  uring_close(ring, conn->fd);
+  conn_pool_put(pool, conn);
+  METRIC_ADD(connections_closed, 1);
+}
+
+static void uring_chain_start(struct io_uring *ring, uring_conn_t *conn) {
+  conn->recv_buf = 0;
+  conn->send_buf = -1;
+  conn->pending_buf = -1;
+  if (config.chain == CHAIN_DOUBLE) {
+    conn->buffers[0] = conn->buffer;
+    conn->buffers[1] = conn->buffer + BUFFER_SIZE;
+  }
+  uring_conn_recv(ring, conn);
+}
+
+static void uring_double_send(struct io_uring *ring, uring_conn_t *conn,
+                              int buf, unsigned int len) {
+  conn->send_buf = buf;
+  conn->send_req.buffer = conn->buffers[buf];
+  conn->send_req.len = len;
+  uring_conn_send(ring, conn);
+}
+
+// Posts a recv into whichever buffer is free, if any.
+static void uring_double_recv(struct io_uring *ring, uring_conn_t *conn) {
+  for (int buf = 0; buf < 2; buf++) {
+    if (buf != conn->send_buf && buf != conn->pending_buf) {
+      conn->recv_buf = buf;
+      conn->buffer = conn->buffers[buf];
+      uring_conn_recv(ring, conn);
+      return;
+    }
+  }
+}
+
+static void uring_chain_complete(struct io_uring *ring, conn_pool_t *pool,
+                                 request_t *req, struct io_uring_cqe *cqe) {
+  uring_conn_t *conn = req->conn;
+  int res = cqe->res;
+
+  if (config.chain == CHAIN_LINK) {
+    if (req->type == OP_READ) {
+      if (res > 0 && !conn->send_failed) {
+        METRIC_ADD(total_bytes, res);
+        METRIC_ADD(total_messages, 1);
+
+        // A flush between the two SQEs would submit the send with its link
+        // dangling, so make room for the pair up front.
+        if (io_uring_sq_space_left(ring) < 2) {
+          uring_submit(ring);
+        }
+
+        conn->send_req.buffer = conn->buffer;
+        conn->send_req.len = res;
+        struct io_uring_sqe *sqe = uring_conn_send(ring, conn);
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->flags |= IOSQE_IO_LINK;
+        if ((ring->features & IORING_FEAT_CQE_SKIP) && !config.latency) {
+          sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+        }
+        latency_record(LATENCY_RECV_SEND, latency_wakeup_ns);
+        uring_conn_recv(ring, conn);
+        return;
+      }
+
+      // Cancelled because the send in front of it failed, whose completion
+      // may still be on its way.
+      conn->recv_done = 1;
+      if (res != -ECANCELED || conn->send_failed) {
+        uring_chain_close(ring, pool, conn);
+      }
+    } else if (req->type == OP_WRITE) {
+      latency_record(LATENCY_SEND, req->start_ns);
+      if (res == (int)req->len) {
+        return;
+      }
+
+      // Without MSG_WAITALL retries a short send leaves the recv running,
+      // end it so the echo can't go out of order.
+      conn->send_failed = 1;
+      if (conn->recv_done) {
+        uring_chain_close(ring, pool, conn);
+      } else if (res > 0) {
+        uring_shutdown(ring, conn->fd);
+      }
+    }
+    return;
+  }
+
+  if (req->type == OP_READ) {
+    int buf = conn->recv_buf;
+    conn->recv_buf = -1;
+
+    if (res > 0 && !conn->send_failed) {
+      METRIC_ADD(total_bytes, res);
+      METRIC_ADD(total_messages, 1);
+
+      if (conn->send_buf < 0) {
+        uring_double_send(ring, conn, buf, res);
+        latency_record(LATENCY_RECV_SEND, latency_wakeup_ns);
+      } else {
+        conn->pending_buf = buf;
+        conn->pending_len = res;
+      }
+      uring_double_recv(ring, conn);
+      return;
+    }
+
+    conn->recv_done = 1;
+  } else if (req->type == OP_WRITE) {
+    latency_record(LATENCY_SEND, req->start_ns);
+
+    if (res > 0 && (size_t)res < req->len) {
+      // Short send, push out the rest before the pending buffer.
+      req->buffer += res;
+      req->len -= res;
+      uring_conn_send(ring, conn);
+      return;
+    }
+
+    conn->send_buf = -1;
+    if (res <= 0) {
+      // Drop what is pending and end the recv, the peer is gone.
+      conn->send_failed = 1;
+      conn->pending_buf = -1;
+      if (conn->recv_buf >= 0) {
+        uring_shutdown(ring, conn->fd);
+      } else {
+        conn->recv_done = 1;
+      }
+    } else if (conn->pending_buf >= 0) {
+      uring_double_send(ring, conn, conn->pending_buf, conn->pending_len);
+      conn->pending_buf = -1;
+    }
+
+    if (conn->recv_buf < 0 && !conn->recv_done) {
+      uring_double_recv(ring, conn);
+    }
+  }
+
+  // Data received before the recv ended is still echoed first.
+  if (conn->recv_done && conn->recv_buf < 0 && conn->send_buf < 0) {
+    if (conn->pending_buf >= 0) {
+      uring_double_send(ring, conn, conn->pending_buf, conn->pending_len);
+      conn->pending_buf = -1;
+      return;
+    }
+    uring_chain_close(ring, pool, conn);
+  }
+}
+
+void run_uring_server(reactor_t *r) {
+  int listen_fd = r->listen_fd;
+
+  struct io_uring ring;
+  uring_init(&ring, r, 0);
+
+  uring_setup_files(&ring, listen_fd);
+
+  conn_pool_t pool;
+  if (conn_pool_init(&pool, sizeof(uring_conn_t), config.max_conns,
+                     config.chain == CHAIN_DOUBLE ? 2 * BUFFER_SIZE
+                                                  : BUFFER_SIZE) < 0) {
+    fprintf(stderr, "Failed to allocate connection pool\n");
+    exit(1);
+  }
+
+  if (config.fixed_buffers) {
+    uring_register_arena(&ring, &pool);
+  }
+
+  if (r->id == 0) {
+    printf("IO_URING server listening on port %d%s\n", r->port,
+           config.fixed_buffers ? " (registered buffers)" : "");
+    if (config.chain != CHAIN_NONE) {
+      printf("Recv/send chaining: %s\n", chain_mode_names[config.chain]);
+    }
+  }
+
+  // Submit initial accept.
+  request_t accept_req = {.type = OP_ACCEPT, .fd = listen_fd};
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  uring_prep_accept(sqe, listen_fd, 0);
+  io_uring_sqe_set_data(sqe, &accept_req);
+  uring_submit(&ring);
+
+  while (running) {
+    // Submit everything the last batch queued and wait for completions.
+    struct io_uring_cqe *cqe;
+    int ret = uring_submit_and_wait(&ring, &cqe);
+    reactor_wakeup(r);
+
+    if (ret == -ETIME) {
+      reactor_report(r);
+      continue;
+    }
+
+    if (ret < 0) {
+      fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
+      break;
+    }
+
+    // Drain every available completion before submitting again.
+    unsigned int head;
+    unsigned int count = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      count++;
+
+      request_t *req = io_uring_cqe_get_data(cqe);
+      int res = cqe->res;
+
+      if (!req) {
+        continue;
+      }
+      trace_cqe(req, cqe);
+
+      uring_conn_t *conn = req->conn;
+
+      if (req->type == OP_ACCEPT) {
+        if (res >= 0) {
+          // Mark connection as accepted
+          int client_fd = res;
+          uring_accepted(client_fd);
+          reactor_accepted(r, client_fd);
+
+          conn = conn_pool_get(&pool);
+          if (conn) {
+            conn->fd = client_fd;
+            conn->buffer = conn_pool_buffer(&pool, conn);
+            conn->recv_req = (request_t){.type = OP_READ,
+                                         .fd = client_fd,
+                                         .len = BUFFER_SIZE,
+                                         .conn = conn};
+            conn->send_req =
+                (request_t){.type = OP_WRITE, .fd = client_fd, .conn = conn};
+
+            // Submit read for the new connection.
+            if (config.chain != CHAIN_NONE) {
+              uring_chain_start(&ring, conn);
+            } else {
+              uring_conn_recv(&ring, conn);
+            }
+            latency_record(LATENCY_ACCEPT, latency_wakeup_ns);
+          } else {
+            uring_close(&ring, client_fd);
+            METRIC_ADD(connections_rejected, 1);
+            METRIC_ADD(connections_closed, 1);
+          }
+        } else {
+          METRIC_ADD(accept_errors, 1);
+        }
+
+        // Submit another accept for the next connection.
+        if (uring_accept_done(cqe, 0)) {
+          sqe = uring_get_sqe(&ring);
+          uring_prep_accept(sqe, listen_fd, 0);
+          io_uring_sqe_set_data(sqe, &accept_req);
+        }
+      } else if (config.chain != CHAIN_NONE) {
+        uring_chain_complete(&ring, &pool, req, cqe);
+      } else if (req->type == OP_READ) {
+        if (res > 0) {
+          METRIC_ADD(total_bytes, res);
+          METRIC_ADD(total_messages, 1);
+
+          // Echo.
+          conn->send_req.buffer = conn->buffer;
+          conn->send_req.len = res;
+          uring_conn_send(&ring, conn);
+          latency_record(LATENCY_RECV_SEND, latency_wakeup_ns);
+        } else {
+          // Connection closed or errored out, cleanup.
+          uring_close(&ring, conn->fd);
+          conn_pool_put(&pool, conn);
+          METRIC_ADD(connections_closed, 1);
+        }
+      } else if (req->type == OP_WRITE) {
+        latency_record(LATENCY_SEND, req->start_ns);
+        if (res > 0 && (size_t)res < req->len) {
+          // Short send, push out the rest before reading again.
+          req->buffer += res;
+          req->len -= res;
+          uring_conn_send(&ring, conn);
+        } else if (res > 0) {
+          // After write completion, submit another read.
+          uring_conn_recv(&ring, conn);
+        } else {
+          uring_close(&ring, conn->fd);
+          conn_pool_put(&pool, conn);
+          METRIC_ADD(connections_closed, 1);
+        }
+      }
+    }
+
+    uring_batch_done(&ring, count);
+    reactor_report(r);
+  }
+
+  io_uring_queue_exit(&ring);
+  conn_pool_destroy(&pool);
+  close(listen_fd);
+}
+
+/*
+**
+** io_uring (single shot) with zero-copy send.
+**
+** A zero-copy send posts two completions: the send result, flagged with
+** IORING_CQE_F_MORE, and later an IORING_CQE_F_NOTIF completion once the
+** kernel no longer references the pages. Each connection owns two buffers
+** so the next recv can be posted while the previous buffer is still pinned.
+** Messages below the threshold go out with a regular send.
+**
+*/
+#define ZC_BUFFER_SIZE 16384
+#define ZC_THRESHOLD 4096
+
+typedef struct {
+  int fd;
+  request_t recv_req;
+  request_t send_req[2];
+  char *buffers[2];
+  int notif_pending[2];
+  int recv_buf;
+  int send_buf;
+  unsigned int send_len;
+  unsigned int send_off;
+  int recv_waiting;
+  int closed;
+} zc_conn_t;
+
+static void zc_conn_recv(struct io_uring *ring, zc_conn_t *conn, int buf) {
+  conn->recv_buf = buf;
+  conn->recv_waiting = 0;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  io_uring_prep_recv(sqe, conn->fd, conn->buffers[buf], ZC_BUFFER_SIZE, 0);
+  uring_sqe_set_file(sqe);
+  io_uring_sqe_set_data(sqe, &conn->recv_req);
+}
+
+static void zc_conn_send(struct io_uring *ring, zc_conn_t *conn) {
+  int buf = conn->send_buf;
+  char *data = conn->buffers[buf] + conn->send_off;
+  unsigned int len = conn->send_len - conn->send_off;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (len >= (unsigned int)config.zc_threshold) {
+    io_uring_prep_send_zc(sqe, conn->fd, data, len, 0,
+                          IORING_SEND_ZC_REPORT_USAGE);
+    METRIC_ADD(zc_sends, 1);
+  } else {
+    io_uring_prep_send(sqe, conn->fd, data, len, 0);
+    METRIC_ADD(copy_sends, 1);
+  }
+  uring_sqe_set_file(sqe);
+  io_uring_sqe_set_data(sqe, &conn->send_req[buf]);
+  conn->send_req[buf].len = len;
+  conn->send_req[buf].start_ns = latency_now();
+}
+
+/*
+**
+** Posts the next recv into whichever buffer isn't pinned by a zero-copy
+** send, or parks the connection until a notification frees one.
+**
+*/
+static void zc_conn_next_recv(struct io_uring *ring, zc_conn_t *conn) {
+  int buf = conn->send_buf ^ 1;
+  if (conn->notif_pending[buf] && !conn->notif_pending[buf ^ 1]) {
+    buf ^= 1;
+  }
+
+  if (conn->notif_pending[buf]) {
+    conn->recv_waiting = 1;
+    return;
+  }
+
+  zc_conn_recv(ring, conn, buf);
+}
+
+static zc_conn_t *zc_conn_create(conn_pool_t *pool, int fd) {
+  zc_conn_t *conn = conn_pool_get(pool);
+  if (!conn) {
+    return NULL;
+  }
+
+  char *buffer = conn_pool_buffer(pool, conn);
+  for (int i = 0; i < 2; i++) {
+    conn->buffers[i] = buffer + i * ZC_BUFFER_SIZE;
+    conn->send_req[i].type = OP_WRITE;
+    conn->send_req[i].fd = fd;
+    conn->send_req[i].buffer_id = i;
+    conn->send_req[i].conn = conn;
+  }
+
+  conn->fd = fd;
+  conn->recv_req.type = OP_READ;
+  conn->recv_req.fd = fd;
+  conn->recv_req.len = ZC_BUFFER_SIZE;
+  conn->recv_req.conn = conn;
+
+  return conn;
+}
+
+/*
+**
+** Closes the socket right away but keeps the connection (and its buffers)
+** alive until every outstanding notification has been reaped.
+**
+*/
+static void zc_conn_close(struct io_uring *ring, conn_pool_t *pool,
+                          zc_conn_t *conn) {
+  if (!conn->closed) {
+    uring_close(ring, conn->fd);
+    conn->closed = 1;
+    METRIC_ADD(connections_closed, 1);
+  }
+
+  if (!conn->notif_pending[0] && !conn->notif_pending[1]) {
+    conn_pool_put(pool, conn);
+  }
+}
+
+void run_uring_zc_server(reactor_t *r) {
+  int listen_fd = r->listen_fd;
+
+  struct io_uring ring;
+  uring_init(&ring, r, 0);
+
+  uring_setup_files(&ring, listen_fd);
+
+  conn_pool_t pool;
+  if (conn_pool_init(&pool, sizeof(zc_conn_t), config.max_conns,
+                     2 * ZC_BUFFER_SIZE) < 0) {
+    fprintf(stderr, "Failed to allocate connection pool\n");
+    exit(1);
+  }
+
+  if (r->id == 0) {
+    printf("IO_URING zero-copy server listening on port %d\n", r->port);
+    printf("Zero-copy threshold: %d bytes\n", config.zc_threshold);
+  }
+
+  // Submit multishot accept.
+  request_t accept_req = {.type = OP_ACCEPT, .fd = listen_fd};
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  uring_prep_accept(sqe, listen_fd, 1);
+  io_uring_sqe_set_data(sqe, &accept_req);
+  uring_submit(&ring);
+
+  while (running) {
+    // Submit everything the last batch queued and wait for completions.
+    struct io_uring_cqe *cqe;
+    int ret = uring_submit_and_wait(&ring, &cqe);
+    reactor_wakeup(r);
+
+    if (ret == -ETIME) {
+      reactor_report(r);
+      continue;
+    }
+
+    if (ret < 0) {
+      fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
+      break;
+    }
+
+    // Drain every available completion before submitting again.
+    unsigned int head;
+    unsigned int count = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      count++;
+
+      request_t *req = io_uring_cqe_get_data(cqe);
+      int res = cqe->res;
+
+      if (!req) {
+        continue;
+      }
+      trace_cqe(req, cqe);
+
+      zc_conn_t *conn = req->conn;
+
+      if (req->type == OP_ACCEPT) {
+        if (res >= 0) {
+          int client_fd = res;
+          uring_accepted(client_fd);
+          reactor_accepted(r, client_fd);
+
+          conn = zc_conn_create(&pool, client_fd);
+          if (conn) {
+            zc_conn_recv(&ring, conn, 0);
+            latency_record(LATENCY_ACCEPT, latency_wakeup_ns);
+          } else {
+            uring_close(&ring, client_fd);
+            METRIC_ADD(connections_rejected, 1);
+            METRIC_ADD(connections_closed, 1);
+          }
+        } else {
+          METRIC_ADD(accept_errors, 1);
+        }
+
+        if (uring_accept_done(cqe, 1)) {
+          sqe = uring_get_sqe(&ring);
+          uring_prep_accept(sqe, listen_fd, 1);
+          io_uring_sqe_set_data(sqe, &accept_req);
+        }
+      } else if (req->type == OP_READ) {
+        if (res > 0) {
+          METRIC_ADD(total_bytes, res);
+          METRIC_ADD(total_messages, 1);
+
+          // Echo.
+          conn->send_buf = conn->recv_buf;
+          conn->send_len = res;
+          conn->send_off = 0;
+          zc_conn_send(&ring, conn);
+          latency_record(LATENCY_RECV_SEND, latency_wakeup_ns);
+        } else {
+          zc_conn_close(&ring, &pool, conn);
+        }
+      } else if (cqe->flags & IORING_CQE_F_NOTIF) {
+        // The kernel is done with the pages, the buffer can be reused.
+        int buf = req->buffer_id;
+        conn->notif_pending[buf]--;
+        if ((unsigned int)res & IORING_NOTIF_USAGE_ZC_COPIED) {
+          METRIC_ADD(zc_copied, 1);
+        }
+
+        if (conn->closed) {
+          zc_conn_close(&ring, &pool, conn);
+        } else if (conn->recv_waiting && !conn->notif_pending[buf]) {
+          zc_conn_recv(&ring, conn, buf);
+        }
+      } else if (req->type == OP_WRITE) {
+        latency_record(LATENCY_SEND, req->start_ns);
+        if (cqe->flags & IORING_CQE_F_MORE) {
+          conn->notif_pending[req->buffer_id]++;
+        }
+
+        if (res < 0 || conn->closed) {
+          zc_conn_close(&ring, &pool, conn);
+        } else {
+          conn->send_off += res;
+          if (conn->send_off < conn->send_len) {
+            zc_conn_send(&ring, conn);
+          } else {
+            zc_conn_next_recv(&ring, conn);
+          }
+        }
+      }
+    }
+
+    uring_batch_done(&ring, count);
+    reactor_report(r);
+  }
+
+  io_uring_queue_exit(&ring);
+  conn_pool_destroy(&pool);
+  close(listen_fd);
+}
+
+/*
+**
+** io_uring (multishot).
+**
+*/
+
+#define BUFFER_RING_SIZE 256
+#define BUFFER_RING_SIZE_DIRECT 4096
+#define BUFFER_RING_MAX 32768
+#define BUFFER_GROUP_ID 1
+#define INC_BUFFER_SIZE (64 * 1024)
+#define BUFFER_SIZE_MAX (1024 * 1024)
+
+/*
+**
+** Buffer ring management API.
+**
+** With --buf-inc the ring is registered with IOU_PBUF_RING_INC: the kernel
+** no longer hands out a whole buffer per recv but only the bytes it needs,
+** and keeps the rest of the buffer at the head of the ring for the next
+** recv, flagging the completion with IORING_CQE_F_BUF_MORE. Consecutive
+** recvs, from any connection, then share one buffer, so each buffer tracks
+** how far it has been consumed and how many slices of it are still in use.
+** It goes back to the ring once the kernel has moved past it and the last
+** slice is released.
+**
+** With --bundle one recv fills a run of buffers, taken in ring order from
+** the one its completion names. Buffers come back in whatever order their
+** sends finish, so each buffer remembers the ring slot it was last added
+** at to find the rest of the run.
+**
+*/
+typedef struct {
+  int pool;
+  int group;
+  int buf_id;
+  unsigned int off;
+  unsigned int len;
+  int next;
+  // Wakeup that delivered the slice, with --latency.
+  long long recv_ns;
+} buf_slice_t;
+
+typedef struct {
+  void *buf_base;
+  struct io_uring_buf_ring *br;
+  int bgid;
+  size_t buf_size;
+  int buf_count;
+  int incremental;
+  // Buffers currently in the ring, available to the kernel.
+  int in_ring;
+  // Buffers filled by completions of the batch being handled, see
+  // ms_batch_out().
+  int filled;
+  unsigned int filled_batch;
+  // Per buffer: bytes handed out so far (incremental) and references, one
+  // held by the kernel while the buffer is in the ring plus one per slice.
+  unsigned int *buf_off;
+  int *buf_refs;
+  unsigned short *buf_pos;
+} buffer_group_t;
+
+/*
+**
+** Creates and registers buffer ring, alternative to `provide_buffers`.
+**
+*/
+static buffer_group_t *create_buffer_ring(struct io_uring *ring, int bgid,
+                                          int buf_count, size_t buf_size,
+                                          int incremental) {
+  buffer_group_t *bg = calloc(1, sizeof(buffer_group_t));
+  if (!bg) {
+    return NULL;
+  }
+
+  bg->bgid = bgid;
+  bg->buf_size = buf_size;
+  bg->buf_count = buf_count;
+  bg->incremental = incremental;
+
+  // Allocate contiguous buffer memory
+  size_t total_size = buf_size * buf_count;
+  bg->buf_base = io_arena_alloc(total_size, 4096);
+  if (!bg->buf_base) {
+    free(bg);
+    return NULL;
+  }
+  memset(bg->buf_base, 0, total_size);
+
+  // Allocate buffer ring structure
+  size_t ring_size = sizeof(struct io_uring_buf) * buf_count;
+  void *ring_mem;
+  if (posix_memalign(&ring_mem, 4096, ring_size)) {
+    io_arena_free(bg->buf_base, total_size);
+    free(bg);
+    return NULL;
+  }
+  memset(ring_mem, 0, ring_size);
+
+  // Register buffer ring with io_uring
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (unsigned long)ring_mem,
+      .ring_entries = buf_count,
+      .bgid = bgid,
+      .flags = incremental ? IOU_PBUF_RING_INC : 0,
+  };
+
+  int ret = io_uring_register_buf_ring(ring, &reg, 0);
+  if (ret) {
+    fprintf(stderr, "Failed to register buffer ring: %s\n", strerror(-ret));
+    free(ring_mem);
+    io_arena_free(bg->buf_base, total_size);
+    free(bg);
+    return NULL;
+  }
+
+  bg->br = (struct io_uring_buf_ring *)ring_mem;
+
+  bg->buf_off = calloc(buf_count, sizeof(unsigned int));
+  bg->buf_refs = calloc(buf_count, sizeof(int));
+  bg->buf_pos = calloc(buf_count, sizeof(unsigned short));
+  if (!bg->buf_off || !bg->buf_refs || !bg->buf_pos) {
+    io_uring_unregister_buf_ring(ring, bgid);
+    free(bg->buf_off);
+    free(bg->buf_refs);
+    free(bg->buf_pos);
+    free(ring_mem);
+    io_arena_free(bg->buf_base, total_size);
+    free(bg);
+    return NULL;
+  }
+
+  // Add all buffers to the ring
+  for (int i = 0; i < buf_count; i++) {
+    bg->buf_refs[i] = 1;
+    bg->buf_pos[i] = i;
+    void *buf_addr = (char *)bg->buf_base + (i * buf_size);
+    io_uring_buf_ring_add(bg->br, buf_addr, buf_size, i,
+                          io_uring_buf_ring_mask(buf_count), i);
+  }
+  io_uring_buf_ring_advance(bg->br, buf_count);
+  bg->in_ring = buf_count;
+
+  return bg;
+}
+
+static void *get_buffer(buffer_group_t *bg, int buf_id) {
+  return (char *)bg->buf_base + (buf_id * bg->buf_size);
+}
+
+static void return_buffer(buffer_group_t *bg, int buf_id) {
+  void *buf_addr = get_buffer(bg, buf_id);
+  bg->buf_pos[buf_id] = bg->br->tail;
+  io_uring_buf_ring_add(bg->br, buf_addr, bg->buf_size, buf_id,
+                        io_uring_buf_ring_mask(bg->buf_count), 0);
+  io_uring_buf_ring_advance(bg->br, 1);
+  bg->in_ring++;
+  METRIC_SUB(ring_buffers_busy, 1);
+}
+
+static void put_buffer(buffer_group_t *bg, int buf_id) {
+  if (--bg->buf_refs[buf_id] == 0) {
+    bg->buf_off[buf_id] = 0;
+    bg->buf_refs[buf_id] = 1;
+    return_buffer(bg, buf_id);
+  }
+}
+
+/*
+**
+** Takes a reference on the data a recv completion landed in and returns a
+** pointer to it. The kernel's own reference is dropped once it is done with
+** the buffer, right away unless the ring is consumed incrementally.
+**
+*/
+static char *consume_buffer(buffer_group_t *bg, struct io_uring_cqe *cqe,
+                            int *buf_id) {
+  int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  unsigned int off = 0;
+
+  if (bg->incremental) {
+    off = bg->buf_off[id];
+    bg->buf_off[id] += cqe->res;
+    METRIC_ADD(ring_bytes_used, cqe->res);
+  } else {
+    METRIC_ADD(ring_bytes_used, bg->buf_size);
+  }
+
+  bg->buf_refs[id]++;
+  if (!bg->incremental || !(cqe->flags & IORING_CQE_F_BUF_MORE)) {
+    bg->in_ring--;
+    METRIC_MAX(ring_buffers_peak, METRIC_ADD(ring_buffers_busy, 1) + 1);
+    put_buffer(bg, id);
+  }
+
+  *buf_id = id;
+  return (char *)get_buffer(bg, id) + off;
+}
+
+/*
+**
+** Takes a reference on the i-th buffer a bundled recv filled and returns
+** its id. Each buffer is filled whole before the next one, so the byte
+** count says how many there are. Not for incremental rings.
+**
+*/
+static int consume_bundle(buffer_group_t *bg, struct io_uring_cqe *cqe,
+                          int i) {
+  int first = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  unsigned short pos = bg->buf_pos[first] + i;
+  int id = bg->br->bufs[pos & io_uring_buf_ring_mask(bg->buf_count)].bid;
+
+  METRIC_ADD(ring_bytes_used, bg->buf_size);
+  bg->buf_refs[id]++;
+  bg->in_ring--;
+  METRIC_MAX(ring_buffers_peak, METRIC_ADD(ring_buffers_busy, 1) + 1);
+  put_buffer(bg, id);
+
+  return id;
+}
+
+static void free_buffer_ring(struct io_uring *ring, buffer_group_t *bg) {
+  if (!bg)
+    return;
+  io_uring_unregister_buf_ring(ring, bg->bgid);
+  if (bg->br)
+    free(bg->br);
+  io_arena_free(bg->buf_base, bg->buf_size * bg->buf_count);
+  free(bg->buf_off);
+  free(bg->buf_refs);
+  free(bg->buf_pos);
+  free(bg);
+}
+
+/*
+**
+** Buffer pool, the buffer groups of one ring.
+**
+** It starts with a single group and registers another one of the same size
+** whenever a recv runs out of buffers (ENOBUFS), up to --buf-mem-max. A
+** connection's recv draws from one group, picked when it is armed, so a new
+** group takes load off the others as connections get re-armed. Connections
+** that hit ENOBUFS with the pool at its cap wait on the starved list until
+** buffers come back.
+**
+*/
+#define BUFFER_GROUPS_MAX 64
+#define BUFFER_MEM_MAX_MB 256
+
+struct ms_conn;
+
+typedef struct {
+  buffer_group_t *groups[BUFFER_GROUPS_MAX];
+  int num_groups;
+  int bgid_base;
+  int buf_count;
+  size_t buf_size;
+  int incremental;
+  size_t max_bytes;
+  // Connections waiting for buffers to re-arm their recv.
+  struct ms_conn *starved_head;
+  struct ms_conn *starved_tail;
+} buffer_pool_t;
+
+static int buffer_pool_grow(buffer_pool_t *bp, struct io_uring *ring) {
+  size_t group_bytes = (size_t)bp->buf_count * bp->buf_size;
+  if (bp->num_groups == BUFFER_GROUPS_MAX ||
+      (bp->num_groups + 1) * group_bytes > bp->max_bytes) {
+    return -1;
+  }
+
+  buffer_group_t *bg =
+      create_buffer_ring(ring, bp->bgid_base + bp->num_groups,
+                         bp->buf_count, bp->buf_size, bp->incremental);
+  if (!bg) {
+    return -1;
+  }
+
+  METRIC_ADD(ring_groups, 1);
+  METRIC_ADD(ring_buffers, bp->buf_count);
+  METRIC_ADD(ring_buffer_bytes, group_bytes);
+
+  bp->groups[bp->num_groups] = bg;
+  return bp->num_groups++;
+}
+
+static int buffer_pool_init(buffer_pool_t *bp, struct io_uring *ring,
+                            int bgid_base, int buf_count, size_t buf_size,
+                            int incremental, size_t max_bytes) {
+  memset(bp, 0, sizeof(*bp));
+  bp->bgid_base = bgid_base;
+  bp->buf_count = buf_count;
+  bp->buf_size = buf_size;
+  bp->incremental = incremental;
+  // The first group is always created, even past the cap.
+  bp->max_bytes = max_bytes > (size_t)buf_count * buf_size
+                      ? max_bytes
+                      : (size_t)buf_count * buf_size;
+
+  return buffer_pool_grow(bp, ring);
+}
+
+/*
+**
+** The group with the most buffers left in its ring.
+**
+*/
+static int buffer_pool_pick(buffer_pool_t *bp) {
+  int best = 0;
+  for (int i = 1; i < bp->num_groups; i++) {
+    if (bp->groups[i]->in_ring > bp->groups[best]->in_ring) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+static int buffer_pool_available(buffer_pool_t *bp) {
+  int available = 0;
+  for (int i = 0; i < bp->num_groups; i++) {
+    available += bp->groups[i]->in_ring;
+  }
+  return available;
+}
+
+static void buffer_pool_destroy(buffer_pool_t *bp, struct io_uring *ring) {
+  for (int i = 0; i < bp->num_groups; i++) {
+    free_buffer_ring(ring, bp->groups[i]);
+  }
+}
+
+/*
+**
+** Buffer size classes, one buffer pool each.
+**
+** With --size-classes the multishot server keeps small, medium and large
+** buffer pools instead of one. Each connection tracks an EWMA of its recv
+** sizes and draws from the smallest class its recent reads fit in, so
+** pings stop pinning large buffers while bulk transfers get fewer, larger
+** recvs. Without it there is a single class of the configured size.
+**
+*/
+#define SIZE_CLASS_MIN_RECVS 8
+
+typedef struct {
+  buffer_pool_t pools[SIZE_CLASSES_MAX];
+  int num_pools;
+  // Slices queued for direct send, linked by index, grown on demand.
+  buf_slice_t *slices;
+  int slice_count;
+  int slice_free;
+  unsigned int batch;
+} buffer_classes_t;
+
+static int get_slice(buffer_classes_t *bc) {
+  if (bc->slice_free < 0) {
+    int count = bc->slice_count ? bc->slice_count * 2 : bc->pools[0].buf_count;
+    buf_slice_t *slices = realloc(bc->slices, sizeof(*slices) * count);
+    if (!slices) {
+      return -1;
+    }
+    METRIC_ADD(heap_allocs, 1);
+
+    for (int i = count - 1; i >= bc->slice_count; i--) {
+      slices[i].next = bc->slice_free;
+      bc->slice_free = i;
+    }
+    bc->slices = slices;
+    bc->slice_count = count;
+  }
+
+  int slice = bc->slice_free;
+  bc->slice_free = bc->slices[slice].next;
+  return slice;
+}
+
+static void put_slice(buffer_classes_t *bc, int slice) {
+  buf_slice_t *s = &bc->slices[slice];
+  put_buffer(bc->pools[s->pool].groups[s->group], s->buf_id);
+  s->next = bc->slice_free;
+  bc->slice_free = slice;
+}
+
+static void buffer_classes_destroy(buffer_classes_t *bc,
+                                   struct io_uring *ring) {
+  for (int i = 0; i < bc->num_pools; i++) {
+    buffer_pool_destroy(&bc->pools[i], ring);
+  }
+  free(bc->slices);
+}
+
+/*
+**
+** Per-connection state for multishot, taken from the connection pool.
+**
+** For direct send, received data is not copied, each recv's slice of the
+** buffer ring is queued on the connection and sent one at a time straight
+** out of the ring, so the echo keeps its byte order. The slice's buffer
+** reference is dropped only once its send completes.
+**
+** With --bundle each connection also owns a small buffer ring of its own,
+** registered once per pool slot, that its queued slices are posted to. A
+** send with IORING_RECVSEND_BUNDLE then pushes out every slice posted so
+** far in one SQE, and keeps going with those posted while it runs. It uses
+** MSG_WAITALL, so it only stops short of a slice on an error.
+**
+*/
+#define BUNDLE_SEND_ENTRIES 256
+#define BUNDLE_SEND_GROUP                                                      \
+  (BUFFER_GROUP_ID + SIZE_CLASSES_MAX * BUFFER_GROUPS_MAX)
+#define BUNDLE_RING_BYTES (BUNDLE_SEND_ENTRIES * sizeof(struct io_uring_buf))
+
+typedef struct ms_conn {
+  int fd;
+  request_t recv_req;
+  request_t send_req;
+  int pool;
+  int group;
+  // Recent recv size and recvs since the recv was armed, to pick its class.
+  int size_ewma;
+  int recvs;
+  int switching;
+  int send_head;
+  int send_tail;
+  unsigned int send_off;
+  int sending;
+  int recv_done;
+  struct ms_conn *starved_next;
+  // Bundled send ring: the first slice not posted to it yet, the slices in
+  // it whose send has not completed, and whether a failed send left the
+  // kernel's view of the ring unknown.
+  struct io_uring_buf_ring *send_br;
+  int send_bgid;
+  int send_posted;
+  int send_ring_count;
+  int send_ring_dirty;
+} ms_conn_t;
+
+/*
+**
+** The smallest size class the connection's recent recvs fit in.
+**
+*/
+static int ms_conn_class(buffer_classes_t *bc, ms_conn_t *conn) {
+  int cls = 0;
+  while (cls < bc->num_pools - 1 &&
+         bc->pools[cls].buf_size < (size_t)conn->size_ewma) {
+    cls++;
+  }
+  return cls;
+}
+
+static void ms_conn_arm(struct io_uring *ring, buffer_classes_t *bc,
+                        ms_conn_t *conn) {
+  conn->pool = ms_conn_class(bc, conn);
+  conn->recvs = 0;
+  conn->switching = 0;
+
+  buffer_pool_t *bp = &bc->pools[conn->pool];
+  conn->group = buffer_pool_pick(bp);
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  io_uring_prep_recv_multishot(sqe, conn->fd, NULL, 0, 0);
+  uring_sqe_set_file(sqe);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bp->groups[conn->group]->bgid;
+  if (config.bundle) {
+    sqe->ioprio |= IORING_RECVSEND_BUNDLE;
+  }
+  io_uring_sqe_set_data(sqe, &conn->recv_req);
+}
+
+/*
+**
+** Feeds a recv into the connection's size EWMA. Once the EWMA points at
+** another class the recv is cancelled, and re-armed there when its final
+** -ECANCELED completion arrives. A recv that filled its buffer only says the
+** data was at least that big, so it counts double to let the connection
+** move up.
+**
+*/
+static void ms_conn_observe(struct io_uring *ring, buffer_classes_t *bc,
+                            ms_conn_t *conn, struct io_uring_cqe *cqe) {
+  int sample = cqe->res;
+
+  METRIC_ADD(class_recvs[conn->pool], 1);
+  METRIC_ADD(class_bytes[conn->pool], sample);
+
+  if (bc->num_pools == 1) {
+    return;
+  }
+
+  if ((size_t)sample == bc->pools[conn->pool].buf_size) {
+    sample *= 2;
+  }
+  conn->size_ewma += (sample - conn->size_ewma) / 4;
+
+  if (++conn->recvs >= SIZE_CLASS_MIN_RECVS && !conn->switching &&
+      (cqe->flags & IORING_CQE_F_MORE) &&
+      ms_conn_class(bc, conn) != conn->pool) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    io_uring_prep_cancel(sqe, &conn->recv_req, 0);
+    io_uring_sqe_set_data(sqe, NULL);
+    conn->switching = 1;
+    METRIC_ADD(class_switches, 1);
+  }
+}
+
+/*
+**
+** A multishot recv ended with ENOBUFS, or emptied its group. Grow the pool
+** and re-arm right away, or at the cap re-arm on whatever buffers are left,
+** and only park the connection until buffers are returned when there are
+** none.
+**
+*/
+static void ms_conn_starved(struct io_uring *ring, buffer_classes_t *bc,
+                            ms_conn_t *conn) {
+  buffer_pool_t *bp = &bc->pools[ms_conn_class(bc, conn)];
+  if (buffer_pool_grow(bp, ring) >= 0 ||
+      bp->groups[buffer_pool_pick(bp)]->in_ring > 0) {
+    METRIC_ADD(recv_rearms, 1);
+    ms_conn_arm(ring, bc, conn);
+    return;
+  }
+
+  METRIC_ADD(recv_starved, 1);
+  conn->starved_next = NULL;
+  if (bp->starved_tail) {
+    bp->starved_tail->starved_next = conn;
+  } else {
+    bp->starved_head = conn;
+  }
+  bp->starved_tail = conn;
+}
+
+/*
+**
+** Re-arms starved connections, one per buffer back in their pool.
+**
+*/
+static void ms_conn_wake_starved(struct io_uring *ring, buffer_classes_t *bc) {
+  for (int i = 0; i < bc->num_pools; i++) {
+    buffer_pool_t *bp = &bc->pools[i];
+    if (!bp->starved_head) {
+      continue;
+    }
+
+    int available = buffer_pool_available(bp);
+    while (bp->starved_head && available-- > 0) {
+      ms_conn_t *conn = bp->starved_head;
+      bp->starved_head = conn->starved_next;
+      if (!bp->starved_head) {
+        bp->starved_tail = NULL;
+      }
+
+      METRIC_ADD(recv_rearms, 1);
+      ms_conn_arm(ring, bc, conn);
+    }
+  }
+}
+
+/*
+**
+** A multishot recv posted its last completion. It ends for good on EOF or
+** a hard error. On ENOBUFS it is re-armed once buffers can be had, and
+** after a cancel to switch size classes right away. The kernel also stops
+** a multishot recv that still delivered data, when the CQ overflowed for
+** instance, and that one is re-armed right away too. Returns 1 once the
+** connection is done receiving.
+**
+** Class switches are the only cancels, but one can land on the recv that
+** replaced the one it was meant for, after that stopped on its own and got
+** re-armed, so any cancel re-arms.
+**
+** A bundled recv also stops, without an error, once it has taken the last
+** buffer of its group. That is the ENOBUFS the next recv would hit, and
+** it gets the pool to grow the same way.
+**
+*/
+static int ms_conn_recv_stopped(struct io_uring *ring, buffer_classes_t *bc,
+                                ms_conn_t *conn, int res) {
+  if (res == -ENOBUFS) {
+    METRIC_ADD(enobufs, 1);
+    ms_conn_starved(ring, bc, conn);
+    return 0;
+  }
+
+  if (res > 0 && bc->pools[conn->pool].groups[conn->group]->in_ring == 0) {
+    ms_conn_starved(ring, bc, conn);
+    return 0;
+  }
+
+  if (res > 0) {
+    METRIC_ADD(recv_rearms, 1);
+    ms_conn_arm(ring, bc, conn);
+    return 0;
+  }
+
+  if (res == -ECANCELED) {
+    ms_conn_arm(ring, bc, conn);
+    return 0;
+  }
+
+  return 1;
+}
+
+static int ms_conn_queue(buffer_classes_t *bc, ms_conn_t *conn, int buf_id,
+                         unsigned int off, unsigned int len) {
+  buffer_group_t *bg = bc->pools[conn->pool].groups[conn->group];
+
+  int slice = get_slice(bc);
+  if (slice < 0) {
+    put_buffer(bg, buf_id);
+    return -1;
+  }
+
+  bc->slices[slice] = (buf_slice_t){
+      .pool = conn->pool,
+      .group = conn->group,
+      .buf_id = buf_id,
+      .off = off,
+      .len = len,
+      .next = -1,
+      .recv_ns = latency_wakeup_ns,
+  };
+  if (conn->send_tail < 0) {
+    conn->send_head = slice;
+  } else {
+    bc->slices[conn->send_tail].next = slice;
+  }
+  conn->send_tail = slice;
+  if (config.bundle && conn->send_posted < 0) {
+    conn->send_posted = slice;
+  }
+  return 0;
+}
+
+/*
+**
+** Queues the data of a recv completion, one slice per buffer of a bundle.
+**
+*/
+static int ms_conn_enqueue(buffer_classes_t *bc, ms_conn_t *conn,
+                           struct io_uring_cqe *cqe) {
+  buffer_group_t *bg = bc->pools[conn->pool].groups[conn->group];
+
+  if (config.bundle) {
+    int count = (cqe->res + bg->buf_size - 1) / bg->buf_size;
+    unsigned int left = cqe->res;
+    int ret = 0;
+
+    METRIC_ADD(bundle_recvs, 1);
+    METRIC_ADD(bundle_recv_bufs, count);
+    for (int i = 0; i < count; i++) {
+      int buf_id = consume_bundle(bg, cqe, i);
+      unsigned int len = left < bg->buf_size ? left : bg->buf_size;
+      left -= len;
+
+      // Out of slices, the rest of the bundle is dropped with the
+      // connection.
+      if (ret < 0) {
+        put_buffer(bg, buf_id);
+      } else {
+        ret = ms_conn_queue(bc, conn, buf_id, 0, len);
+      }
+    }
+    return ret;
+  }
+
+  int buf_id;
+  char *data = consume_buffer(bg, cqe, &buf_id);
+  return ms_conn_queue(bc, conn, buf_id, data - (char *)get_buffer(bg, buf_id),
+                       cqe->res);
+}
+
+/*
+**
+** The held peak only sees buffers the reactor has reaped. Those the kernel
+** has filled while their completions wait in the CQ are just as gone from
+** the ring, and a burst of them is what runs a group dry and makes the pool
+** grow. Before a batch is handled, count them on top of the held ones and
+** keep the high-water mark of the emptiest group, as a share of its size.
+**
+*/
+static void ms_batch_out(struct io_uring *ring, buffer_classes_t *bc) {
+  metrics_t *m = &metrics_self->counters;
+  unsigned int batch = ++bc->batch;
+  struct io_uring_cqe *cqe;
+  unsigned int head;
+
+  io_uring_for_each_cqe(ring, head, cqe) {
+    request_t *req = io_uring_cqe_get_data(cqe);
+    if (!req || req->type != OP_READ || cqe->res <= 0 ||
+        !(cqe->flags & IORING_CQE_F_BUFFER)) {
+      continue;
+    }
+
+    ms_conn_t *conn = req->conn;
+    buffer_group_t *bg = bc->pools[conn->pool].groups[conn->group];
+    if (bg->filled_batch != batch) {
+      bg->filled_batch = batch;
+      bg->filled = 0;
+    }
+    if (config.bundle) {
+      bg->filled += (cqe->res + bg->buf_size - 1) / bg->buf_size;
+    } else if (!bg->incremental || !(cqe->flags & IORING_CQE_F_BUF_MORE)) {
+      bg->filled++;
+    }
+
+    unsigned long long out = bg->buf_count - bg->in_ring + bg->filled;
+    if (!m->ring_group_out_size ||
+        out * m->ring_group_out_size > m->ring_group_out_peak * bg->buf_count) {
+      __atomic_store_n(&m->ring_group_out_peak, out, __ATOMIC_RELAXED);
+      __atomic_store_n(&m->ring_group_out_size, bg->buf_count,
+                       __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void ms_conn_send_head(struct io_uring *ring, buffer_classes_t *bc,
+                              ms_conn_t *conn) {
+  buf_slice_t *slice = &bc->slices[conn->send_head];
+  buffer_group_t *bg = bc->pools[slice->pool].groups[slice->group];
+  char *data =
+      (char *)get_buffer(bg, slice->buf_id) + slice->off + conn->send_off;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  io_uring_prep_send(sqe, conn->fd, data, slice->len - conn->send_off, 0);
+  uring_sqe_set_file(sqe);
+  io_uring_sqe_set_data(sqe, &conn->send_req);
+  conn->send_req.len = slice->len - conn->send_off;
+  conn->sending = 1;
+
+  // Slices queued behind a send count their wait too.
+  if (conn->send_off == 0) {
+    latency_record(LATENCY_RECV_SEND, slice->recv_ns);
+  }
+  conn->send_req.start_ns = latency_now();
+}
+
+/*
+**
+** Posts queued slices to the connection's send ring, as many as fit.
+**
+*/
+static void ms_conn_post(buffer_classes_t *bc, ms_conn_t *conn) {
+  int mask = io_uring_buf_ring_mask(BUNDLE_SEND_ENTRIES);
+  int added = 0;
+
+  while (conn->send_posted >= 0 &&
+         conn->send_ring_count < BUNDLE_SEND_ENTRIES) {
+    buf_slice_t *slice = &bc->slices[conn->send_posted];
+    buffer_group_t *bg = bc->pools[slice->pool].groups[slice->group];
+    unsigned short bid = (conn->send_br->tail + added) & mask;
+
+    io_uring_buf_ring_add(conn->send_br,
+                          (char *)get_buffer(bg, slice->buf_id) + slice->off,
+                          slice->len, bid, mask, added);
+    latency_record(LATENCY_RECV_SEND, slice->recv_ns);
+    conn->send_posted = slice->next;
+    conn->send_ring_count++;
+    added++;
+  }
+
+  if (added) {
+    io_uring_buf_ring_advance(conn->send_br, added);
+  }
+}
+
+static void ms_conn_send_bundle(struct io_uring *ring, ms_conn_t *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  io_uring_prep_send_bundle(sqe, conn->fd, 0, MSG_WAITALL);
+  uring_sqe_set_file(sqe);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = conn->send_bgid;
+  io_uring_sqe_set_data(sqe, &conn->send_req);
+  conn->send_req.len = 0;
+  conn->send_req.start_ns = latency_now();
+  conn->sending = 1;
+  METRIC_ADD(bundle_sends, 1);
+}
+
+/*
+**
+** Drops the slices a bundled send completion covered. Returns -1 if it
+** ended inside a slice, whose ring entry the kernel has consumed anyway.
+**
+*/
+static int ms_conn_bundle_sent(buffer_classes_t *bc, ms_conn_t *conn,
+                               int res) {
+  unsigned int left = res;
+
+  while (left > 0 && conn->send_ring_count > 0) {
+    int slice = conn->send_head;
+    unsigned int len = bc->slices[slice].len;
+
+    conn->send_ring_count--;
+    if (len > left) {
+      return -1;
+    }
+    left -= len;
+
+    conn->send_head = bc->slices[slice].next;
+    if (conn->send_head < 0) {
+      conn->send_tail = -1;
+    }
+    put_slice(bc, slice);
+    METRIC_ADD(bundle_send_bufs, 1);
+  }
+
+  return left ? -1 : 0;
+}
+
+static void ms_conn_release(buffer_classes_t *bc, ms_conn_t *conn) {
+  while (conn->send_head >= 0) {
+    int next = bc->slices[conn->send_head].next;
+    put_slice(bc, conn->send_head);
+    conn->send_head = next;
+  }
+  conn->send_tail = -1;
+  conn->send_off = 0;
+
+  // Entries left in the send ring point at buffers just released.
+  if (conn->send_ring_count) {
+    conn->send_ring_dirty = 1;
+  }
+  conn->send_posted = -1;
+  conn->send_ring_count = 0;
+}
+
+/*
+**
+** Posts what is queued and starts a bundled send unless one is running.
+** After a failed send the connection is on its way out and its data is
+** dropped.
+**
+*/
+static void ms_conn_flush(struct io_uring *ring, buffer_classes_t *bc,
+                          ms_conn_t *conn) {
+  if (conn->send_ring_dirty) {
+    ms_conn_release(bc, conn);
+    return;
+  }
+
+  ms_conn_post(bc, conn);
+  if (!conn->sending && conn->send_ring_count > 0) {
+    ms_conn_send_bundle(ring, conn);
+  }
+}
+
+/*
+**
+** Registers the send ring of a connection slot, empty. One that a failed
+** send left in an unknown state is unregistered and registered afresh.
+**
+*/
+static int ms_send_ring_register(struct io_uring *ring, conn_pool_t *pool,
+                                 int slot, int reset) {
+  struct io_uring_buf_ring *br =
+      (struct io_uring_buf_ring *)(pool->buffers + slot * pool->buf_size);
+
+  if (reset) {
+    io_uring_unregister_buf_ring(ring, BUNDLE_SEND_GROUP + slot);
+  }
+  io_uring_buf_ring_init(br);
+
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (unsigned long)br,
+      .ring_entries = BUNDLE_SEND_ENTRIES,
+      .bgid = BUNDLE_SEND_GROUP + slot,
+  };
+  return io_uring_register_buf_ring(ring, &reg, 0);
+}
+
+/*
+**
+** Handles recv and send completions in direct send mode. The connection is
+** closed once its multishot recv has terminated and no send is in flight.
+**
+*/
+static void ms_conn_complete(struct io_uring *ring, buffer_classes_t *bc,
+                             conn_pool_t *pool, request_t *req,
+                             struct io_uring_cqe *cqe) {
+  ms_conn_t *conn = req->conn;
+  int res = cqe->res;
+
+  if (req->type == OP_READ) {
+    if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+      METRIC_ADD(total_bytes, res);
+      METRIC_ADD(total_messages, 1);
+
+      ms_conn_observe(ring, bc, conn, cqe);
+      if (ms_conn_enqueue(bc, conn, cqe) < 0) {
+        uring_shutdown(ring, conn->fd);
+      } else if (config.bundle) {
+        ms_conn_flush(ring, bc, conn);
+      } else if (!conn->sending) {
+        ms_conn_send_head(ring, bc, conn);
+      }
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      conn->recv_done = ms_conn_recv_stopped(ring, bc, conn, res);
+    }
+  } else if (req->type == OP_WRITE && config.bundle) {
+    // A bundled send posts a completion per round, flagged MORE until the
+    // last one.
+    latency_record(LATENCY_SEND, req->start_ns);
+    req->start_ns = latency_now();
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      conn->sending = 0;
+    }
+
+    if (res > 0 && ms_conn_bundle_sent(bc, conn, res) == 0) {
+      ms_conn_flush(ring, bc, conn);
+    } else {
+      conn->send_ring_dirty = 1;
+      ms_conn_release(bc, conn);
+      uring_shutdown(ring, conn->fd);
+    }
+  } else if (req->type == OP_WRITE) {
+    conn->sending = 0;
+    latency_record(LATENCY_SEND, req->start_ns);
+
+    if (res > 0) {
+      int slice = conn->send_head;
+
+      // Short send, push out the rest of the same slice first.
+      conn->send_off += res;
+      if (conn->send_off < bc->slices[slice].len) {
+        ms_conn_send_head(ring, bc, conn);
+        return;
+      }
+
+      conn->send_head = bc->slices[slice].next;
+      if (conn->send_head < 0) {
+        conn->send_tail = -1;
+      }
+      conn->send_off = 0;
+      put_slice(bc, slice);
+
+      if (conn->send_head >= 0) {
+        ms_conn_send_head(ring, bc, conn);
+      }
+    } else {
+      // The peer is gone, wake up the multishot recv so it terminates too.
+      ms_conn_release(bc, conn);
+      uring_shutdown(ring, conn->fd);
+    }
+  }
+
+  if (conn->recv_done && !conn->sending) {
+    ms_conn_release(bc, conn);
+    uring_close(ring, conn->fd);
+    METRIC_ADD(connections_closed, 1);
+
+    if (conn->send_ring_dirty &&
+        ms_send_ring_register(ring, pool, conn_pool_index(pool, conn), 1)) {
+      fprintf(stderr, "Failed to reset send ring, dropping its slot\n");
+      return;
+    }
+    conn_pool_put(pool, conn);
+  }
+}
+
+void run_uring_multishot_server(reactor_t *r) {
+  int listen_fd = r->listen_fd;
+
+  // FIX #1: Use buffer rings instead of provide_buffers.
+  //
+  // Buffer rings are more efficient and the recommended approach for multishot.
+  //
+  // In direct send mode buffers stay out of the ring until their send
+  // completes, so the ring is sized for every connection to hold a few
+  // buffers without starving the others' recv.
+  //
+  // Incremental rings and size classes other than 4 KiB get the number of
+  // buffers holding the same memory, since many small recvs now pack into
+  // each buffer. The memory cap is split evenly between the classes.
+  int num_pools = config.size_classes ? SIZE_CLASSES_MAX : 1;
+  size_t ring_bytes =
+      (size_t)(config.direct_send ? BUFFER_RING_SIZE_DIRECT
+                                  : BUFFER_RING_SIZE) *
+      BUFFER_SIZE;
+
+  int buf_sizes[SIZE_CLASSES_MAX];
+  int buf_counts[SIZE_CLASSES_MAX];
+  unsigned int ring_buffers = 0;
+  for (int i = 0; i < num_pools; i++) {
+    int buf_size = config.size_classes ? size_classes[i] : config.buf_size;
+    if (buf_size == 0) {
+      buf_size = config.buf_inc ? INC_BUFFER_SIZE : BUFFER_SIZE;
+    }
+
+    int buf_count = config.buf_ring_entries;
+    if (buf_count == 0) {
+      buf_count = 1;
+      while ((size_t)buf_count * 2 * buf_size <= ring_bytes &&
+             buf_count < BUFFER_RING_MAX) {
+        buf_count *= 2;
+      }
+    }
+
+    buf_sizes[i] = buf_size;
+    buf_counts[i] = buf_count;
+    ring_buffers += buf_count;
   }
 
+  // Each buffer the kernel hands out can leave a recv and a send completion
+  // waiting to be reaped. A smaller CQ overflows under pipelined load, which
+  // ends the multishot recvs early.
   struct io_uring ring;
-  struct io_uring_params params;
-  memset(&params, 0, sizeof(params));
+  uring_init(&ring, r, 2 * ring_buffers);
 
-  if (io_uring_queue_init_params(256, &ring, &params) < 0) {
-    perror("io_uring_queue_init_params");
+  if (config.bundle && !(ring.features & IORING_FEAT_RECVSEND_BUNDLE)) {
+    fprintf(stderr, "--bundle needs IORING_RECVSEND_BUNDLE (Linux 6.10)\n");
     exit(1);
   }
 
-  // FIX #1: Use buffer rings instead of provide_buffers.
-  //
-  // Buffer rings are more efficient and the recommended approach for multishot.
-  buffer_group_t *bg =
-      create_buffer_ring(&ring, BUFFER_GROUP_ID, BUFFER_RING_SIZE, BUFFER_SIZE);
-  if (!bg) {
-    fprintf(stderr, "Failed to create buffer ring\n");
+  buffer_classes_t bc = {.num_pools = num_pools, .slice_free = -1};
+  for (int i = 0; i < num_pools; i++) {
+    if (buffer_pool_init(&bc.pools[i], &ring,
+                         BUFFER_GROUP_ID + i * BUFFER_GROUPS_MAX, buf_counts[i],
+                         buf_sizes[i], config.buf_inc,
+                         ((size_t)config.buf_mem_max_mb << 20) / num_pools) <
+        0) {
+      fprintf(stderr, "Failed to create buffer ring\n");
+      exit(1);
+    }
+  }
+
+  uring_setup_files(&ring, listen_fd);
+
+  // With --bundle each slot carries the page of its send ring.
+  conn_pool_t pool;
+  if (conn_pool_init(&pool, sizeof(ms_conn_t), config.max_conns,
+                     config.bundle ? BUNDLE_RING_BYTES : 0) < 0) {
+    fprintf(stderr, "Failed to allocate connection pool\n");
     exit(1);
   }
 
-  printf("io_uring multishot server listening on port %d\n", port);
+  for (int i = 0; config.bundle && i < config.max_conns; i++) {
+    int ret = ms_send_ring_register(&ring, &pool, i, 0);
+    if (ret) {
+      fprintf(stderr, "Failed to register send ring: %s\n", strerror(-ret));
+      exit(1);
+    }
+  }
 
-  // Submit multishot accept
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-  request_t *req = malloc(sizeof(request_t));
-  req->type = OP_ACCEPT;
-  req->fd = listen_fd;
+  if (r->id == 0) {
+    printf("io_uring multishot server listening on port %d\n", r->port);
+    printf("%s send, buffer pools grow up to %d MB per reactor\n",
+           config.direct_send ? "Direct" : "Copying", config.buf_mem_max_mb);
+    for (int i = 0; i < num_pools; i++) {
+      printf("Buffer ring: %d x %zu bytes%s\n", bc.pools[i].buf_count,
+             bc.pools[i].buf_size, config.buf_inc ? " (incremental)" : "");
+    }
+    if (config.bundle) {
+      printf("Bundled recv and send, %d send ring entries per connection\n",
+             BUNDLE_SEND_ENTRIES);
+    }
+  }
 
-  io_uring_prep_multishot_accept(sqe, listen_fd, NULL, NULL, 0);
-  io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&ring);
+  // Submit multishot accept
+  request_t accept_req = {.type = OP_ACCEPT, .fd = listen_fd};
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  uring_prep_accept(sqe, listen_fd, 1);
+  io_uring_sqe_set_data(sqe, &accept_req);
+  uring_submit(&ring);
 
   while (running) {
+    // Submit everything the last batch queued and wait for completions.
     struct io_uring_cqe *cqe;
-    int ret = io_uring_wait_cqe_timeout(
-        &ring, &cqe,
-        &(struct __kernel_timespec){.tv_sec = 0, .tv_nsec = 100000000});
+    int ret = uring_submit_and_wait(&ring, &cqe);
+    reactor_wakeup(r);
 
     if (ret == -ETIME) {
-      print_metrics(0);
+      reactor_report(r);
       continue;
     }
 
     if (ret < 0) {
-      fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-ret));
+      fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
       break;
     }
 
-    request_t *req = io_uring_cqe_get_data(cqe);
-    int res = cqe->res;
+    ms_batch_out(&ring, &bc);
 
-    if (!req) {
-      io_uring_cqe_seen(&ring, cqe);
-      print_metrics(0);
-      continue;
-    }
+    // Drain every available completion before submitting again.
+    unsigned int head;
+    unsigned int count = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      count++;
 
-    // FIX #2: Handle errors properly before processing
-    if (res < 0) {
-      if (res == -ENOBUFS) {
-        fprintf(stderr, "Buffer pool exhausted!\n");
+      request_t *req = io_uring_cqe_get_data(cqe);
+      int res = cqe->res;
+
+      if (!req) {
+        continue;
       }
+      trace_cqe(req, cqe);
 
-      // Clean up on error
-      if (req->type == OP_WRITE && req->buffer) {
-        free(req->buffer);
+      if (config.direct_send && req->type != OP_ACCEPT) {
+        ms_conn_complete(&ring, &bc, &pool, req, cqe);
+        continue;
       }
-      if (req->type != OP_ACCEPT) {
-        free(req);
+
+      // A failed accept, e.g. -ENFILE with the fixed file table full, may
+      // end the multishot accept, which must be re-armed or the reactor
+      // stops taking connections.
+      if (req->type == OP_ACCEPT && res < 0) {
+        METRIC_ADD(accept_errors, 1);
+        if (uring_accept_done(cqe, 1)) {
+          sqe = uring_get_sqe(&ring);
+          uring_prep_accept(sqe, listen_fd, 1);
+          io_uring_sqe_set_data(sqe, &accept_req);
+        }
+        continue;
       }
-      io_uring_cqe_seen(&ring, cqe);
-      continue;
-    }
 
-    if (req->type == OP_ACCEPT) {
-      int client_fd = res;
-      set_tcp_nodelay(client_fd);
-      metrics.connections_accepted++;
-
-      // Init multishot recv for this connection
-      sqe = io_uring_get_sqe(&ring);
-      request_t *recv_req = malloc(sizeof(request_t));
-      recv_req->type = OP_READ;
-      recv_req->fd = client_fd;
-      recv_req->buffer = NULL;
-
-      io_uring_prep_recv_multishot(sqe, client_fd, NULL, 0, 0);
-      sqe->flags |= IOSQE_BUFFER_SELECT;
-      sqe->buf_group = BUFFER_GROUP_ID;
-
-      io_uring_sqe_set_data(sqe, recv_req);
-      io_uring_submit(&ring);
-
-      // FIX #3: Only re-arm accept if multishot stopped
-      // Your original code had the logic inverted
-      if (!(cqe->flags & IORING_CQE_F_MORE)) {
-        sqe = io_uring_get_sqe(&ring);
-        io_uring_prep_multishot_accept(sqe, listen_fd, NULL, NULL, 0);
-        io_uring_sqe_set_data(sqe, req);
-        io_uring_submit(&ring);
-      }
-
-    } else if (req->type == OP_READ) {
-      // Extract buffer ID from CQE flags
-      int buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
-      char *data = get_buffer(bg, buffer_id);
-
-      metrics.total_bytes += res;
-      metrics.total_messages++;
-
-      // FIX #4: Use async send instead of blocking send()
-      // Allocate a copy of the data for async send
-      sqe = io_uring_get_sqe(&ring);
-      request_t *write_req = malloc(sizeof(request_t));
-      write_req->type = OP_WRITE;
-      write_req->fd = req->fd;
-      write_req->buffer = malloc(res);
-      write_req->len = res;
-      memcpy(write_req->buffer, data, res);
-
-      io_uring_prep_send(sqe, req->fd, write_req->buffer, res, 0);
-      io_uring_sqe_set_data(sqe, write_req);
-      io_uring_submit(&ring);
-
-      // KEY FIX #5: Return buffer immediately after copying
-      // Don't wait for send to complete
-      return_buffer(bg, buffer_id);
-
-      // Check if multishot recv continues
-      if (!(cqe->flags & IORING_CQE_F_MORE)) {
-        close(req->fd);
-        free(req);
-        metrics.connections_closed++;
+      // FIX #2: Handle errors properly before processing
+      if (res < 0) {
+        // Out of buffers or cancelled to move to another size class, the
+        // recv stopped but the connection is fine.
+        if (req->type == OP_READ && !(cqe->flags & IORING_CQE_F_MORE) &&
+            !ms_conn_recv_stopped(&ring, &bc, req->conn, res)) {
+          continue;
+        }
+
+        // Clean up on error
+        if (req->type == OP_WRITE) {
+          free(req->buffer);
+          free(req);
+        } else if (req->type == OP_READ) {
+          ms_conn_t *conn = req->conn;
+          uring_close(&ring, conn->fd);
+          conn_pool_put(&pool, conn);
+          METRIC_ADD(connections_closed, 1);
+        }
+        continue;
       }
 
-    } else if (req->type == OP_WRITE) {
-      // Send completed, free the copied buffer
-      if (req->buffer) {
+      if (req->type == OP_ACCEPT) {
+        int client_fd = res;
+        uring_accepted(client_fd);
+        reactor_accepted(r, client_fd);
+
+        ms_conn_t *conn = conn_pool_get(&pool);
+        if (conn) {
+          conn->fd = client_fd;
+          conn->send_head = -1;
+          conn->send_tail = -1;
+          conn->recv_req =
+              (request_t){.type = OP_READ, .fd = client_fd, .conn = conn};
+          conn->send_req =
+              (request_t){.type = OP_WRITE, .fd = client_fd, .conn = conn};
+          conn->send_posted = -1;
+          if (config.bundle) {
+            conn->send_br =
+                (struct io_uring_buf_ring *)conn_pool_buffer(&pool, conn);
+            conn->send_bgid = BUNDLE_SEND_GROUP + conn_pool_index(&pool, conn);
+          }
+
+          // Init multishot recv for this connection
+          conn->size_ewma = BUFFER_SIZE;
+          ms_conn_arm(&ring, &bc, conn);
+          latency_record(LATENCY_ACCEPT, latency_wakeup_ns);
+        } else {
+          uring_close(&ring, client_fd);
+          METRIC_ADD(connections_rejected, 1);
+          METRIC_ADD(connections_closed, 1);
+        }
+
+        // FIX #3: Only re-arm accept if multishot stopped
+        // Your original code had the logic inverted
+        if (uring_accept_done(cqe, 1)) {
+          sqe = uring_get_sqe(&ring);
+          uring_prep_accept(sqe, listen_fd, 1);
+          io_uring_sqe_set_data(sqe, &accept_req);
+        }
+
+      } else if (req->type == OP_READ) {
+        if (res > 0) {
+          // Extract buffer ID from CQE flags
+          ms_conn_t *conn = req->conn;
+          buffer_group_t *bg = bc.pools[conn->pool].groups[conn->group];
+          int buffer_id;
+          char *data = consume_buffer(bg, cqe, &buffer_id);
+          ms_conn_observe(&ring, &bc, conn, cqe);
+
+          METRIC_ADD(total_bytes, res);
+          METRIC_ADD(total_messages, 1);
+
+          // FIX #4: Use async send instead of blocking send()
+          // Allocate a copy of the data for async send, this is the
+          // allocation that direct send (-d) gets rid of.
+          sqe = uring_get_sqe(&ring);
+          request_t *write_req = malloc(sizeof(request_t));
+          write_req->type = OP_WRITE;
+          write_req->fd = req->fd;
+          write_req->buffer = malloc(res);
+          write_req->len = res;
+          write_req->conn = NULL;
+          memcpy(write_req->buffer, data, res);
+          METRIC_ADD(heap_allocs, 2);
+
+          io_uring_prep_send(sqe, req->fd, write_req->buffer, res, 0);
+          uring_sqe_set_file(sqe);
+          io_uring_sqe_set_data(sqe, write_req);
+          latency_record(LATENCY_RECV_SEND, latency_wakeup_ns);
+          write_req->start_ns = latency_now();
+
+          // KEY FIX #5: Return buffer immediately after copying
+          // Don't wait for send to complete
+          put_buffer(bg, buffer_id);
+        }
+
+        // Check if multishot recv continues, it is re-armed unless the peer
+        // closed.
+        if (!(cqe->flags & IORING_CQE_F_MORE) &&
+            ms_conn_recv_stopped(&ring, &bc, req->conn, res)) {
+          ms_conn_t *conn = req->conn;
+          uring_close(&ring, conn->fd);
+          conn_pool_put(&pool, conn);
+          METRIC_ADD(connections_closed, 1);
+        }
+
+      } else if (req->type == OP_WRITE) {
+        // Send completed, free the copied buffer
+        latency_record(LATENCY_SEND, req->start_ns);
         free(req->buffer);
+        free(req);
       }
-      free(req);
     }
 
-    io_uring_cqe_seen(&ring, cqe);
-    print_metrics(0);
+    ms_conn_wake_starved(&ring, &bc);
+    uring_batch_done(&ring, count);
+    reactor_report(r);
   }
 
-  printf("\n");
-  print_metrics(1);
-
-  free_buffer_ring(&ring, bg, BUFFER_GROUP_ID);
+  buffer_classes_destroy(&bc, &ring);
   io_uring_queue_exit(&ring);
+  conn_pool_destroy(&pool);
   close(listen_fd);
 }
 
+/*
+**
+** Reactor thread entry point.
+**
+*/
+static void *reactor_main(void *arg) {
+  reactor_t *r = arg;
+
+  metrics_self = &metrics_slots[r->id];
+  if (config.latency) {
+    latency_self = latency_hists[r->id];
+  }
+  reactor_bind(r);
+  if (config.trace_file) {
+    trace_open(r->id);
+  }
+
+  switch (r->mode) {
+  case MODE_EPOLL:
+    run_epoll_server(r);
+    break;
+  case MODE_URING:
+    run_uring_server(r);
+    break;
+  case MODE_URING_MULTISHOT:
+    run_uring_multishot_server(r);
+    break;
+  case MODE_URING_ZC:
+    run_uring_zc_server(r);
+    break;
+  }
+
+  // A loop that broke out mid-batch leaves it open.
+  metrics_end();
+  return NULL;
+}
+
 void help(const char *prog) {
-  printf("Usage: %s [-m mode] [-p port]\n", prog);
-  printf("  -m mode: epoll, uring, multishot (default: epoll)\n");
+  printf("Usage: %s [-m mode] [-p port] [-T threads]\n", prog);
+  printf("  -m mode: epoll, uring, multishot, uring-zc (default: epoll)\n");
   printf("  -p port: port number (default :%d)\n", PORT);
+  printf("  -T threads: number of reactors, one listener each (default: 1)\n");
+  printf("  -c conns: io_uring connection pool size per reactor "
+         "(default: %d)\n",
+         MAX_CONN);
+  printf("  -f: io_uring modes use registered files and direct accept\n");
+  printf("  -r: uring mode recvs and sends through registered buffers\n");
+  printf("  -d: multishot sends straight from the buffer ring (no copy)\n");
+  printf("  -b entries: multishot buffer ring entries, power of two "
+         "(default: %d, %d with -d)\n",
+         BUFFER_RING_SIZE, BUFFER_RING_SIZE_DIRECT);
+  printf("  --buf-size bytes: multishot buffer size (default: %d, %d with "
+         "--buf-inc)\n",
+         BUFFER_SIZE, INC_BUFFER_SIZE);
+  printf("  --buf-mem-max mb: multishot adds buffer groups on ENOBUFS up to "
+         "this much memory per reactor (default: %d)\n",
+         BUFFER_MEM_MAX_MB);
+  printf("  --size-classes: multishot uses %d, %d and %d byte buffer pools, "
+         "picked per connection from its recent recv sizes\n",
+         size_classes[0], size_classes[1], size_classes[2]);
+  printf("  --hugepages: back I/O buffers and connection tables with huge "
+         "pages (MAP_HUGETLB, else transparent huge pages)\n");
+  printf("  --numa nodes: bind reactors round-robin to NUMA nodes, a list "
+         "such as 0,1 or auto for every node\n");
+  printf("  --incoming-cpu: pin each reactor to one CPU of its node and "
+         "steer its listener there with SO_INCOMING_CPU (implies --numa "
+         "auto)\n");
+  printf("  --cpus list: pin reactors round-robin to CPUs, a list such as "
+         "0-3,8\n");
+  printf("  --reuseport-cpu: steer connections to the reactor pinned to the "
+         "CPU they arrive on (SO_ATTACH_REUSEPORT_CBPF, pins reactors to the "
+         "first CPUs without --cpus)\n");
+  printf("  --latency: record per-reactor latency histograms of recv to "
+         "send, send and accept, printed at shutdown\n");
+  printf("  --trace file: record every op into per-reactor rings and write "
+         "them to file at shutdown, see trace_decode.py\n");
+  printf("  --trace-entries n: events kept per reactor, power of two "
+         "(default: %d)\n",
+         TRACE_ENTRIES);
+  printf("  --chain mode: uring overlaps recv and send, link (IOSQE_IO_LINK "
+         "send -> recv) or double (two buffers, recv posted during send)\n");
+  printf("  --buf-inc: multishot buffer ring is consumed incrementally "
+         "(IOU_PBUF_RING_INC)\n");
+  printf("  --bundle: multishot -d recvs and sends runs of buffers in one op "
+         "(IORING_RECVSEND_BUNDLE)\n");
+  printf("  -z bytes: uring-zc uses a regular send below this size "
+         "(default: %d)\n",
+         ZC_THRESHOLD);
+  printf("  --sqpoll: io_uring modes submit through a kernel SQ thread\n");
+  printf("  --sq-idle ms: SQ thread idle time before it sleeps "
+         "(default: %d)\n",
+         SQ_IDLE_MS);
+  printf("  --sq-cpu cpu: pin the SQ threads, reactor N uses cpu + N\n");
+  printf("  --ring-profile name: io_uring setup flags, default, coop "
+         "(COOP_TASKRUN) or defer (SINGLE_ISSUER + DEFER_TASKRUN)\n");
+  printf("  --shared-listener: epoll reactors share one listener "
+         "(EPOLLEXCLUSIVE) instead of SO_REUSEPORT\n");
+  printf("  --busy-poll usec: busy poll for up to usec before sleeping "
+         "(SO_BUSY_POLL + EPIOCSPARAMS, io_uring NAPI)\n");
 }
 
+/*
+**
+** Options without a short form.
+**
+*/
+enum {
+  OPT_SQPOLL = 256,
+  OPT_SQ_IDLE,
+  OPT_SQ_CPU,
+  OPT_RING_PROFILE,
+  OPT_SHARED_LISTENER,
+  OPT_BUSY_POLL,
+  OPT_BUF_SIZE,
+  OPT_BUF_INC,
+  OPT_BUF_MEM_MAX,
+  OPT_SIZE_CLASSES,
+  OPT_HUGEPAGES,
+  OPT_NUMA,
+  OPT_INCOMING_CPU,
+  OPT_CPUS,
+  OPT_REUSEPORT_CPU,
+  OPT_LATENCY,
+  OPT_TRACE,
+  OPT_TRACE_ENTRIES,
+  OPT_CHAIN,
+  OPT_BUNDLE,
+};
+
+static const struct option long_options[] = {
+    {"sqpoll", no_argument, NULL, OPT_SQPOLL},
+    {"sq-idle", required_argument, NULL, OPT_SQ_IDLE},
+    {"sq-cpu", required_argument, NULL, OPT_SQ_CPU},
+    {"ring-profile", required_argument, NULL, OPT_RING_PROFILE},
+    {"shared-listener", no_argument, NULL, OPT_SHARED_LISTENER},
+    {"busy-poll", required_argument, NULL, OPT_BUSY_POLL},
+    {"buf-size", required_argument, NULL, OPT_BUF_SIZE},
+    {"buf-inc", no_argument, NULL, OPT_BUF_INC},
+    {"buf-mem-max", required_argument, NULL, OPT_BUF_MEM_MAX},
+    {"size-classes", no_argument, NULL, OPT_SIZE_CLASSES},
+    {"hugepages", no_argument, NULL, OPT_HUGEPAGES},
+    {"numa", required_argument, NULL, OPT_NUMA},
+    {"incoming-cpu", no_argument, NULL, OPT_INCOMING_CPU},
+    {"cpus", required_argument, NULL, OPT_CPUS},
+    {"reuseport-cpu", no_argument, NULL, OPT_REUSEPORT_CPU},
+    {"latency", no_argument, NULL, OPT_LATENCY},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"trace-entries", required_argument, NULL, OPT_TRACE_ENTRIES},
+    {"chain", required_argument, NULL, OPT_CHAIN},
+    {"bundle", no_argument, NULL, OPT_BUNDLE},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
 int main(int argc, char **argv) {
   server_mode_t mode = MODE_EPOLL;
   int port = PORT;
+  int num_reactors = 1;
+  const char *numa_spec = NULL;
+  const char *cpus_spec = NULL;
+
+  config.zc_threshold = ZC_THRESHOLD;
+  config.max_conns = MAX_CONN;
+  config.sq_idle_ms = SQ_IDLE_MS;
+  config.sq_cpu = -1;
+  config.buf_mem_max_mb = BUFFER_MEM_MAX_MB;
+  config.trace_entries = TRACE_ENTRIES;
 
   // Parse arguments.
   int opt;
-  while ((opt = getopt(argc, argv, "m:p:h")) != -1) {
+  while ((opt = getopt_long(argc, argv, "m:p:T:c:frdb:z:h", long_options,
+                            NULL)) != -1) {
     switch (opt) {
     case 'm':
       if (strcmp(optarg, "epoll") == 0) {
@@ -769,6 +4274,8 @@ int main(int argc, char **argv) {
         mode = MODE_URING;
       } else if (strcmp(optarg, "multishot") == 0) {
         mode = MODE_URING_MULTISHOT;
+      } else if (strcmp(optarg, "uring-zc") == 0) {
+        mode = MODE_URING_ZC;
       } else {
         fprintf(stderr, "Invalid mode; %s\n", optarg);
         help(argv[0]);
@@ -778,6 +4285,145 @@ int main(int argc, char **argv) {
     case 'p':
       port = atoi(optarg);
       break;
+    case 'T':
+      num_reactors = atoi(optarg);
+      if (num_reactors < 1 || num_reactors > MAX_REACTORS) {
+        fprintf(stderr, "Invalid thread count: %s (1-%d)\n", optarg,
+                MAX_REACTORS);
+        exit(1);
+      }
+      break;
+    case 'c':
+      config.max_conns = atoi(optarg);
+      if (config.max_conns < 1) {
+        fprintf(stderr, "Invalid connection count: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'f':
+      config.fixed_files = 1;
+      break;
+    case 'r':
+      config.fixed_buffers = 1;
+      break;
+    case 'd':
+      config.direct_send = 1;
+      break;
+    case 'b':
+      config.buf_ring_entries = atoi(optarg);
+      if (config.buf_ring_entries < 1 ||
+          config.buf_ring_entries > BUFFER_RING_MAX ||
+          (config.buf_ring_entries & (config.buf_ring_entries - 1))) {
+        fprintf(stderr, "Invalid buffer ring size: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'z':
+      config.zc_threshold = atoi(optarg);
+      break;
+    case OPT_SQPOLL:
+      config.sqpoll = 1;
+      break;
+    case OPT_SQ_IDLE:
+      config.sq_idle_ms = atoi(optarg);
+      if (config.sq_idle_ms < 0) {
+        fprintf(stderr, "Invalid SQ thread idle time: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_SQ_CPU:
+      config.sq_cpu = atoi(optarg);
+      if (config.sq_cpu < 0) {
+        fprintf(stderr, "Invalid SQ thread CPU: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_RING_PROFILE:
+      if (strcmp(optarg, "default") == 0) {
+        config.ring_profile = RING_PROFILE_DEFAULT;
+      } else if (strcmp(optarg, "coop") == 0) {
+        config.ring_profile = RING_PROFILE_COOP;
+      } else if (strcmp(optarg, "defer") == 0) {
+        config.ring_profile = RING_PROFILE_DEFER;
+      } else {
+        fprintf(stderr, "Invalid ring profile: %s\n", optarg);
+        help(argv[0]);
+        exit(1);
+      }
+      break;
+    case OPT_SHARED_LISTENER:
+      config.shared_listener = 1;
+      break;
+    case OPT_BUSY_POLL:
+      config.busy_poll_usec = atoi(optarg);
+      if (config.busy_poll_usec < 0) {
+        fprintf(stderr, "Invalid busy poll time: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_BUF_SIZE:
+      config.buf_size = atoi(optarg);
+      if (config.buf_size < 1 || config.buf_size > BUFFER_SIZE_MAX) {
+        fprintf(stderr, "Invalid buffer size: %s (1-%d)\n", optarg,
+                BUFFER_SIZE_MAX);
+        exit(1);
+      }
+      break;
+    case OPT_BUF_INC:
+      config.buf_inc = 1;
+      break;
+    case OPT_BUF_MEM_MAX:
+      config.buf_mem_max_mb = atoi(optarg);
+      if (config.buf_mem_max_mb < 1) {
+        fprintf(stderr, "Invalid buffer memory cap: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_SIZE_CLASSES:
+      config.size_classes = 1;
+      break;
+    case OPT_HUGEPAGES:
+      config.hugepages = 1;
+      break;
+    case OPT_NUMA:
+      numa_spec = optarg;
+      break;
+    case OPT_INCOMING_CPU:
+      config.incoming_cpu = 1;
+      break;
+    case OPT_CPUS:
+      cpus_spec = optarg;
+      break;
+    case OPT_REUSEPORT_CPU:
+      config.reuseport_cpu = 1;
+      break;
+    case OPT_LATENCY:
+      config.latency = 1;
+      break;
+    case OPT_TRACE:
+      config.trace_file = optarg;
+      break;
+    case OPT_TRACE_ENTRIES:
+      config.trace_entries = atoi(optarg);
+      if (config.trace_entries < 1 ||
+          (config.trace_entries & (config.trace_entries - 1))) {
+        fprintf(stderr, "Invalid trace entries: %s (power of two)\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_CHAIN:
+      if (strcmp(optarg, "link") == 0) {
+        config.chain = CHAIN_LINK;
+      } else if (strcmp(optarg, "double") == 0) {
+        config.chain = CHAIN_DOUBLE;
+      } else {
+        fprintf(stderr, "Invalid chain mode: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPT_BUNDLE:
+      config.bundle = 1;
+      break;
     case 'h':
       help(argv[0]);
       exit(0);
@@ -787,23 +4433,292 @@ int main(int argc, char **argv) {
     }
   }
 
+  // The kernel refuses task_work flags on an SQPOLL ring, the SQ thread is
+  // the one running the completions there.
+  if (config.sqpoll && config.ring_profile != RING_PROFILE_DEFAULT) {
+    fprintf(stderr, "--ring-profile %s can't be combined with --sqpoll\n",
+            ring_profile_names[config.ring_profile]);
+    exit(1);
+  }
+
+  if (config.size_classes && (config.buf_size || config.buf_ring_entries)) {
+    fprintf(stderr, "--size-classes sets the buffer sizes and counts, it "
+                    "can't be combined with --buf-size or -b\n");
+    exit(1);
+  }
+
+  if (config.chain != CHAIN_NONE && mode != MODE_URING) {
+    fprintf(stderr, "--chain is only supported in uring mode\n");
+    exit(1);
+  }
+
+  // WRITE_FIXED has no MSG_WAITALL to keep a linked send from going short.
+  if (config.chain == CHAIN_LINK && config.fixed_buffers) {
+    fprintf(stderr, "--chain link can't be combined with -r\n");
+    exit(1);
+  }
+
+  // Bundles send out of the buffer ring, and a bundled recv needs whole
+  // buffers to find where its data ends.
+  if (config.bundle && (mode != MODE_URING_MULTISHOT || !config.direct_send)) {
+    fprintf(stderr, "--bundle is only supported in multishot mode with -d\n");
+    exit(1);
+  }
+
+  if (config.bundle && config.buf_inc) {
+    fprintf(stderr, "--bundle can't be combined with --buf-inc\n");
+    exit(1);
+  }
+
+  // Every connection slot has a buffer group id of its own.
+  if (config.bundle && BUNDLE_SEND_GROUP + config.max_conns > 65536) {
+    fprintf(stderr, "--bundle supports at most %d connections per reactor\n",
+            65536 - BUNDLE_SEND_GROUP);
+    exit(1);
+  }
+
+  if (config.shared_listener && mode != MODE_EPOLL) {
+    fprintf(stderr, "--shared-listener is only supported in epoll mode\n");
+    exit(1);
+  }
+
+  if (config.incoming_cpu && config.shared_listener) {
+    fprintf(stderr, "--incoming-cpu needs a listener per reactor, it can't "
+                    "be combined with --shared-listener\n");
+    exit(1);
+  }
+
+  if (config.reuseport_cpu && config.shared_listener) {
+    fprintf(stderr, "--reuseport-cpu needs a listener per reactor, it can't "
+                    "be combined with --shared-listener\n");
+    exit(1);
+  }
+
+  if (config.incoming_cpu && !numa_spec) {
+    numa_spec = "auto";
+  }
+
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  if (cpus_spec) {
+    cpu_set_t cpus;
+    if (parse_cpulist(cpus_spec, &cpus) < 0 || CPU_COUNT(&cpus) == 0) {
+      fprintf(stderr, "Invalid CPU list: %s\n", cpus_spec);
+      exit(1);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &cpus)) {
+        continue;
+      }
+      if (!CPU_ISSET(cpu, &allowed)) {
+        fprintf(stderr, "CPU %d is not online or not allowed\n", cpu);
+        exit(1);
+      }
+      if (config.cpu_count < MAX_REACTORS) {
+        config.cpus[config.cpu_count++] = cpu;
+      }
+    }
+  } else if (config.reuseport_cpu) {
+    // One CPU per reactor, the first ones the process may run on.
+    for (int cpu = 0; cpu < CPU_SETSIZE && config.cpu_count < num_reactors;
+         cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        config.cpus[config.cpu_count++] = cpu;
+      }
+    }
+  }
+
+  if (config.reuseport_cpu && config.cpu_count < num_reactors) {
+    fprintf(stderr, "Warning: %d reactors share %d CPUs, --reuseport-cpu "
+                    "only steers to the first reactor on each\n",
+            num_reactors, config.cpu_count);
+  }
+
+  if (numa_spec) {
+    numa_init();
+    if (strcmp(numa_spec, "auto") == 0) {
+      for (int i = 0; i < numa_num_nodes; i++) {
+        config.numa_nodes[config.numa_count++] = numa_nodes[i].id;
+      }
+    } else {
+      cpu_set_t nodes;
+      if (parse_cpulist(numa_spec, &nodes) < 0) {
+        fprintf(stderr, "Invalid NUMA node list: %s\n", numa_spec);
+        exit(1);
+      }
+      for (int n = 0; n < CPU_SETSIZE; n++) {
+        if (!CPU_ISSET(n, &nodes)) {
+          continue;
+        }
+        numa_node_t *node = n < MAX_NUMA_NODES ? numa_node(n) : NULL;
+        if (!node || CPU_COUNT(&node->cpus) == 0) {
+          fprintf(stderr, "NUMA node %d is not online or has no CPUs\n", n);
+          exit(1);
+        }
+        config.numa_nodes[config.numa_count++] = n;
+      }
+    }
+  }
+
   signal(SIGINT, sigint_handler);
   signal(SIGTERM, sigint_handler);
+  raise_fd_limit();
 
-  clock_gettime(CLOCK_MONOTONIC, &metrics.start_time);
-  metrics.last_report_time = metrics.start_time;
+  // Create every listener up front so they join the SO_REUSEPORT group in
+  // reactor order before any of them starts accepting. A shared listener is
+  // created once and handed to every reactor.
+  reactor_t *reactors = calloc(num_reactors, sizeof(reactor_t));
+  if (!reactors) {
+    perror("calloc");
+    exit(1);
+  }
 
-  switch (mode) {
-  case MODE_EPOLL:
-    run_epoll_server(port);
-    break;
-  case MODE_URING:
-    run_uring_server(port);
-    break;
-  case MODE_URING_MULTISHOT:
-    run_uring_multishot_server(port);
-    break;
+  // Reactors go round-robin over the --cpus list, each on the node of its
+  // CPU, or else round-robin over the NUMA nodes. With --incoming-cpu each
+  // also takes the next CPU of its node.
+  int node_reactors[MAX_NUMA_NODES] = {0};
+
+  for (int i = 0; i < num_reactors; i++) {
+    reactors[i].id = i;
+    reactors[i].mode = mode;
+    reactors[i].port = port;
+    reactors[i].node = -1;
+    reactors[i].cpu = -1;
+
+    if (config.cpu_count) {
+      reactors[i].cpu = config.cpus[i % config.cpu_count];
+      if (config.numa_count) {
+        reactors[i].node = numa_cpu_node(reactors[i].cpu);
+      }
+    } else if (config.numa_count) {
+      reactors[i].node = config.numa_nodes[i % config.numa_count];
+      if (config.incoming_cpu) {
+        reactors[i].cpu = numa_node_cpu(numa_node(reactors[i].node),
+                                        node_reactors[reactors[i].node]++);
+      }
+    }
+
+    if (config.shared_listener && i > 0) {
+      reactors[i].listen_fd = reactors[0].listen_fd;
+      continue;
+    }
+
+    reactors[i].listen_fd = create_listening_socket(port);
+    if (reactors[i].listen_fd < 0) {
+      exit(1);
+    }
+
+    // The reuseport lookup prefers the listener whose SO_INCOMING_CPU is
+    // the CPU the SYN was processed on.
+    if (config.incoming_cpu &&
+        setsockopt(reactors[i].listen_fd, SOL_SOCKET, SO_INCOMING_CPU,
+                   &reactors[i].cpu, sizeof(reactors[i].cpu)) < 0) {
+      perror("setsockopt(SO_INCOMING_CPU)");
+    }
+  }
+
+  // Every listener has joined the group by now.
+  if (config.reuseport_cpu &&
+      attach_reuseport_cpu_prog(reactors[0].listen_fd, reactors,
+                                num_reactors) < 0) {
+    exit(1);
+  }
+
+  if (num_reactors > 1) {
+    printf("Running %d reactors on port %d (%s)\n", num_reactors, port,
+           config.shared_listener ? "shared listener, EPOLLEXCLUSIVE"
+                                  : "SO_REUSEPORT");
+  }
+
+  if (mode != MODE_EPOLL && config.ring_profile != RING_PROFILE_DEFAULT) {
+    printf("Ring profile: %s\n", ring_profile_names[config.ring_profile]);
+  }
+
+  if (config.numa_count) {
+    printf("NUMA topology:");
+    for (int i = 0; i < numa_num_nodes; i++) {
+      printf(" node %d (cpus %s)", numa_nodes[i].id, numa_nodes[i].cpulist);
+    }
+    printf("\n");
+  }
+
+  const char *steering = config.reuseport_cpu   ? " (reuseport CBPF)"
+                         : config.incoming_cpu ? " (SO_INCOMING_CPU)"
+                                               : "";
+  for (int i = 0; i < num_reactors; i++) {
+    reactor_t *r = &reactors[i];
+    if (r->node >= 0 && r->cpu >= 0) {
+      printf("Reactor %d: node %d, cpu %d%s\n", i, r->node, r->cpu, steering);
+    } else if (r->node >= 0) {
+      printf("Reactor %d: node %d, cpus %s\n", i, r->node,
+             numa_node(r->node)->cpulist);
+    } else if (r->cpu >= 0) {
+      printf("Reactor %d: cpu %d%s\n", i, r->cpu, steering);
+    }
+  }
+
+  tlb_counters_open();
+  clock_gettime(CLOCK_MONOTONIC, &metrics_start_time);
+  metrics_last_time = metrics_start_time;
+
+  for (int i = 0; i < num_reactors; i++) {
+    if (pthread_create(&reactors[i].thread, NULL, reactor_main,
+                       &reactors[i]) != 0) {
+      fprintf(stderr, "Failed to create reactor %d\n", i);
+      exit(1);
+    }
+  }
+
+  pthread_t reporter;
+  if (pthread_create(&reporter, NULL, reporter_main, NULL) != 0) {
+    fprintf(stderr, "Failed to create the reporter thread\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < num_reactors; i++) {
+    pthread_join(reactors[i].thread, NULL);
+  }
+
+  // Reactors can also stop on an error.
+  running = 0;
+  pthread_join(reporter, NULL);
+
+  printf("\n");
+  print_metrics(1);
+
+  // How evenly connections were spread across the reactors.
+  if (num_reactors > 1) {
+    printf("\nAccepts per reactor:");
+    for (int i = 0; i < num_reactors; i++) {
+      printf(" %llu", reactors[i].accepted);
+    }
+  }
+  printf("\n");
+
+  // Whether each pinned reactor's connections arrived on its own core.
+  if (reactors[0].cpu >= 0) {
+    printf("\nPer-core locality:\n");
+    for (int i = 0; i < num_reactors; i++) {
+      reactor_t *r = &reactors[i];
+      printf("  reactor %d, cpu %d: %llu accepted", i, r->cpu, r->accepted);
+      if (r->incoming_known) {
+        printf(", %llu arrived on cpu %d (%.1f%%)", r->incoming_local, r->cpu,
+               100.0 * r->incoming_local / r->incoming_known);
+      }
+      printf("\n");
+    }
+  }
+
+  if (config.trace_file) {
+    trace_dump(num_reactors, get_ns(&metrics_start_time));
+  }
+
+  if (config.shared_listener) {
+    close(reactors[0].listen_fd);
   }
 
+  free(reactors);
+
   return 0;
 }
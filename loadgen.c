@@ -4,11 +4,13 @@
 #include <liburing.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
@@ -18,6 +20,17 @@
 #define DEFAULT_MESSAGE_SIZE 1024
 #define DEFAULT_DURATION 30
 #define SEC_NS 1000000000LL
+#define PIPELINE_STALL_MS 5000
+
+/*
+**
+** Round-trip latencies go into a log-linear histogram: one power of two per
+** group of 2^LAT_SUB_BITS buckets, which keeps the error under 12.5% over
+** the whole range with a fixed 4 KiB table per thread.
+**
+*/
+#define LAT_SUB_BITS 3
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
 
 typedef struct {
   unsigned long long messages_sent;
@@ -25,6 +38,9 @@ typedef struct {
   unsigned long long bytes_sent;
   unsigned long long bytes_received;
   unsigned long long errors;
+  unsigned long long reconnects;
+  unsigned long long latency_samples;
+  unsigned long long latency[LAT_BUCKETS];
 } thread_state_t;
 
 typedef struct {
@@ -34,6 +50,8 @@ typedef struct {
   int num_connections;
   int message_size;
   int duration_sec;
+  int reconnect_every;
+  int pipeline;
   thread_state_t stats;
 } thread_args_t;
 
@@ -50,11 +68,60 @@ static inline long long get_ns(void) {
   return (long long)ts.tv_sec * SEC_NS + ts.tv_nsec;
 }
 
+static inline int lat_bucket(unsigned long long ns) {
+  if (ns < (1ULL << LAT_SUB_BITS)) {
+    return ns;
+  }
+
+  int shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+  return ((shift + 1) << LAT_SUB_BITS) +
+         ((ns >> shift) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/*
+**
+** Largest latency that falls into a bucket.
+**
+*/
+static unsigned long long lat_bucket_max(int bucket) {
+  if (bucket < (1 << LAT_SUB_BITS)) {
+    return bucket;
+  }
+
+  int shift = (bucket >> LAT_SUB_BITS) - 1;
+  unsigned long long base =
+      ((1ULL << LAT_SUB_BITS) + (bucket & ((1 << LAT_SUB_BITS) - 1)))
+      << shift;
+  return base + (1ULL << shift) - 1;
+}
+
+static double lat_percentile(const unsigned long long *hist,
+                             unsigned long long count, double p) {
+  unsigned long long rank = (unsigned long long)(count * p);
+  unsigned long long seen = 0;
+
+  for (int i = 0; i < LAT_BUCKETS; i++) {
+    seen += hist[i];
+    if (seen > rank) {
+      return lat_bucket_max(i) / 1000.0;
+    }
+  }
+  return 0.0;
+}
+
 void set_tcp_nodelay(int fd) {
   int flag = 1;
   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
 }
 
+void raise_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
 int connect_to_server(const char *ip, int port) {
   int fd = socket(AF_INET, SOCK_STREAM, 0);
   if (fd < 0) {
@@ -80,20 +147,95 @@ int connect_to_server(const char *ip, int port) {
   return fd;
 }
 
+/*
+**
+** Pipelined round trip: sends len bytes, message_size at a time, while
+** reading the echo back, so neither side blocks on a full socket buffer
+** while the other waits. Fails if the echo stalls for PIPELINE_STALL_MS.
+**
+*/
+static int echo_pipelined(int fd, const char *send_buf, char *recv_buf,
+                          size_t len, size_t message_size) {
+  size_t sent = 0;
+  size_t received = 0;
+
+  while (received < len) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (sent < len) {
+      pfd.events |= POLLOUT;
+    }
+
+    int ret = poll(&pfd, 1, PIPELINE_STALL_MS);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return -1;
+    }
+
+    if (pfd.revents & POLLOUT) {
+      size_t chunk = message_size - sent % message_size;
+      ssize_t n = send(fd, send_buf + sent, chunk, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n < 0 && errno != EAGAIN) {
+        return -1;
+      }
+      if (n > 0) {
+        sent += n;
+      }
+    }
+
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+      ssize_t n =
+          recv(fd, recv_buf + received, len - received, MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN)) {
+        return -1;
+      }
+      if (n > 0) {
+        received += n;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*
+**
+** Connection churn, replace the connection every N round trips.
+**
+*/
+static void churn(thread_args_t *args, int *fd, int *round_trips) {
+  if (!args->reconnect_every || ++*round_trips % args->reconnect_every) {
+    return;
+  }
+
+  close(*fd);
+  *fd = connect_to_server(args->server_ip, args->port);
+  if (*fd < 0) {
+    args->stats.errors++;
+  } else {
+    args->stats.reconnects++;
+  }
+}
+
 void *worker_thread(void *arg) {
   thread_args_t *args = (thread_args_t *)arg;
 
   int *fds = malloc(sizeof(int) * args->num_connections);
-  char *send_buf = malloc(args->message_size);
-  char *recv_buf = malloc(args->message_size);
+  int *round_trips = calloc(args->num_connections, sizeof(int));
+  size_t round_bytes = (size_t)args->message_size * args->pipeline;
+  char *send_buf = malloc(round_bytes);
+  char *recv_buf = malloc(round_bytes);
 
-  if (!fds || !send_buf || !recv_buf) {
+  if (!fds || !round_trips || !send_buf || !recv_buf) {
     fprintf(stderr, "Thread %d: Memory allocation failed\n", args->thread_id);
     return NULL;
   }
 
-  for (int i = 0; i < args->message_size; i++) {
-    send_buf[i] = 'A' + (i % 26);
+  // Pipelined messages differ from one another, so lost or reordered data
+  // shows up as a mismatch.
+  for (size_t i = 0; i < round_bytes; i++) {
+    send_buf[i] = 'A' + (i + i / args->message_size * 7) % 26;
   }
 
   printf("Thread %d: Connecting %d sockets...\n", args->thread_id,
@@ -117,6 +259,35 @@ void *worker_thread(void *arg) {
       if (fds[i] < 0)
         continue;
 
+      long long send_time = get_ns();
+      if (args->pipeline > 1) {
+        if (echo_pipelined(fds[i], send_buf, recv_buf, round_bytes,
+                           args->message_size) < 0) {
+          fprintf(stderr, "Thread %d: Pipelined echo failed on socket %d\n",
+                  args->thread_id, i);
+          args->stats.errors++;
+          close(fds[i]);
+          fds[i] = -1;
+          continue;
+        }
+
+        args->stats.latency[lat_bucket(get_ns() - send_time)]++;
+        args->stats.latency_samples++;
+        args->stats.messages_sent += args->pipeline;
+        args->stats.messages_received += args->pipeline;
+        args->stats.bytes_sent += round_bytes;
+        args->stats.bytes_received += round_bytes;
+
+        if (memcmp(send_buf, recv_buf, round_bytes) != 0) {
+          fprintf(stderr, "Thread %d: Echo mismatch on socket %d\n",
+                  args->thread_id, i);
+          args->stats.errors++;
+        }
+
+        churn(args, &fds[i], &round_trips[i]);
+        continue;
+      }
+
       // Echo send.
       ssize_t sent = send(fds[i], send_buf, args->message_size, 0);
       if (sent < 0) {
@@ -146,6 +317,8 @@ void *worker_thread(void *arg) {
       }
 
       if (total_received == args->message_size) {
+        args->stats.latency[lat_bucket(get_ns() - send_time)]++;
+        args->stats.latency_samples++;
         args->stats.messages_received++;
         args->stats.bytes_received += total_received;
 
@@ -154,6 +327,8 @@ void *worker_thread(void *arg) {
                   args->thread_id, i);
           args->stats.errors++;
         }
+
+        churn(args, &fds[i], &round_trips[i]);
       }
     }
   }
@@ -165,6 +340,7 @@ void *worker_thread(void *arg) {
   }
 
   free(fds);
+  free(round_trips);
   free(send_buf);
   free(recv_buf);
 
@@ -183,6 +359,10 @@ void help(const char *prog) {
   printf("  -m size Message size in bytes (default: %d)\n",
          DEFAULT_MESSAGE_SIZE);
   printf("  -d duration Duration in seconds (default: %d)\n", DEFAULT_DURATION);
+  printf("  -r count Reconnect each connection after count round trips "
+         "(default: 0, never)\n");
+  printf("  -P depth Pipeline depth messages per round trip, checking the "
+         "whole echo (default: 1)\n");
   printf("  -h Display this help message\n");
 }
 
@@ -193,9 +373,11 @@ int main(int argc, char **argv) {
   int num_threads = 1;
   int message_size = DEFAULT_MESSAGE_SIZE;
   int duration_sec = DEFAULT_DURATION;
+  int reconnect_every = 0;
+  int pipeline = 1;
 
   int opt;
-  while ((opt = getopt(argc, argv, "s:p:c:t:m:d:h")) != -1) {
+  while ((opt = getopt(argc, argv, "s:p:c:t:m:d:r:P:h")) != -1) {
     switch (opt) {
     case 's':
       server_ip = optarg;
@@ -215,6 +397,12 @@ int main(int argc, char **argv) {
     case 'd':
       duration_sec = atoi(optarg);
       break;
+    case 'r':
+      reconnect_every = atoi(optarg);
+      break;
+    case 'P':
+      pipeline = atoi(optarg);
+      break;
     case 'h':
       help(argv[0]);
       exit(0);
@@ -229,8 +417,14 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  if (pipeline < 1 || (long long)pipeline * message_size > 64 * 1024 * 1024) {
+    fprintf(stderr, "Invalid pipeline depth: %d\n", pipeline);
+    exit(1);
+  }
+
   signal(SIGINT, sigint_handler);
   signal(SIGTERM, sigint_handler);
+  raise_fd_limit();
 
   printf("=== Echo Server Benchmark ===\n");
   printf("[+] Server:                 %s:%d\n", server_ip, port);
@@ -240,6 +434,9 @@ int main(int argc, char **argv) {
          num_threads * connections_per_thread);
   printf("[+] Message size;           %d bytes\n", message_size);
   printf("[+] Duration:               %d seconds\n", duration_sec);
+  if (pipeline > 1) {
+    printf("[+] Pipeline depth:         %d messages\n", pipeline);
+  }
   printf("\n\n");
 
   pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
@@ -254,6 +451,8 @@ int main(int argc, char **argv) {
     thread_args[i].num_connections = connections_per_thread;
     thread_args[i].message_size = message_size;
     thread_args[i].duration_sec = duration_sec;
+    thread_args[i].reconnect_every = reconnect_every;
+    thread_args[i].pipeline = pipeline;
     memset(&thread_args[i].stats, 0, sizeof(thread_state_t));
 
     if (pthread_create(&threads[i], NULL, worker_thread, &thread_args[i]) !=
@@ -275,6 +474,9 @@ int main(int argc, char **argv) {
   unsigned long long total_bytes_sent = 0;
   unsigned long long total_bytes_received = 0;
   unsigned long long total_errors = 0;
+  unsigned long long total_reconnects = 0;
+  unsigned long long total_latency_samples = 0;
+  static unsigned long long latency[LAT_BUCKETS];
 
   for (int i = 0; i < num_threads; i++) {
     total_messages_sent += thread_args[i].stats.messages_sent;
@@ -282,6 +484,11 @@ int main(int argc, char **argv) {
     total_bytes_sent += thread_args[i].stats.bytes_sent;
     total_bytes_received += thread_args[i].stats.bytes_received;
     total_errors += thread_args[i].stats.errors;
+    total_reconnects += thread_args[i].stats.reconnects;
+    total_latency_samples += thread_args[i].stats.latency_samples;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+      latency[b] += thread_args[i].stats.latency[b];
+    }
   }
 
   printf("\n=== Results ===\n");
@@ -292,6 +499,10 @@ int main(int argc, char **argv) {
   printf("  Received: %llu (%.2f msg/s)\n", total_messages_received,
          total_messages_received / elapsed_sec);
   printf("  Errors:   %llu\n", total_errors);
+  if (reconnect_every) {
+    printf("  Reconnects: %llu (%.2f/s)\n", total_reconnects,
+           total_reconnects / elapsed_sec);
+  }
 
   printf("\nThroughput (sent):\n");
   printf("  Bytes:    %llu (%.2f MB)\n)", total_bytes_sent,
@@ -307,6 +518,13 @@ int main(int argc, char **argv) {
          (total_bytes_received / elapsed_sec) / (1024.0 * 1024.0),
          (total_bytes_received * 8.0 / elapsed_sec) / 1000000.0);
 
+  printf("\nLatency (round trip, us):\n");
+  printf("  p50: %.1f  p90: %.1f  p99: %.1f  p99.9: %.1f\n",
+         lat_percentile(latency, total_latency_samples, 0.50),
+         lat_percentile(latency, total_latency_samples, 0.90),
+         lat_percentile(latency, total_latency_samples, 0.99),
+         lat_percentile(latency, total_latency_samples, 0.999));
+
   printf("\nPer-Thread statistics\n");
   for (int i = 0; i < num_threads; i++) {
     printf("  Thread %d: %llu msg sent, %llu msg recv, %llu errors\n", i,
@@ -41,14 +41,18 @@ def parse_result_file(filepath):
 
 def parse_filename(filename):
     """Extract test parameters from filename."""
-    match = re.match(r'(\w+)_t(\d+)_c(\d+)_m(\d+)\.txt', filename)
+    # Expected format: mode[_pPROFILE]_tTHREADS_cCONNS_mMSGSIZE.txt
+    match = re.match(r'([\w-]+?)(?:_p(\w+))?_t(\d+)_c(\d+)_m(\d+)\.txt', filename)
     if match:
+        mode = match.group(1)
+        if match.group(2):
+            mode = f"{mode}/{match.group(2)}"
         return {
-            'mode': match.group(1),
-            'threads': int(match.group(2)),
-            'conns': int(match.group(3)),
-            'msgsize': int(match.group(4)),
-            'total_conns': int(match.group(2)) * int(match.group(3))
+            'mode': mode,
+            'threads': int(match.group(3)),
+            'conns': int(match.group(4)),
+            'msgsize': int(match.group(5)),
+            'total_conns': int(match.group(3)) * int(match.group(4))
         }
     return None
 
@@ -57,6 +57,45 @@ run_quick_test() {
   fi
 }
 
+# Pipelined echo with a small buffer ring: many messages in flight per
+# connection must come back whole and in order, however the server's recvs
+# get cut short.
+run_pipelined_test() {
+  local flags=$1
+  local port=9999
+
+  echo "Testing pipelined echo with $flags ..."
+
+  ./echobench $flags -p $port > /tmp/test_server.log 2>&1 &
+  local server_pid=$!
+
+  sleep 2
+
+  if ! kill -0 $server_pid 2>/dev/null; then
+    echo "  ✗ FAILED: Server didn't start"
+    cat /tmp/test_server.log
+    return 1
+  fi
+
+  ./loadgen -s 127.0.0.1 -p $port -t 1 -c 16 -m 3000 -P 1000 -d 3 > /tmp/test_client.log 2>&1
+  local client_exit=$?
+
+  local errors=$(grep "Errors:" /tmp/test_client.log | grep -oP '[0-9]+')
+
+  kill -INT $server_pid 2>/dev/null
+  wait $server_pid 2>/dev/null
+
+  if [ $client_exit -eq 0 ] && [ "$errors" == "0" ]; then
+    echo "  ✓ SUCCESS: no errors"
+    return 0
+  else
+    echo "  ✗ FAILED"
+    echo "Client log:"
+    cat /tmp/test_client.log
+    return 1
+  fi
+}
+
 modes=("epoll")
 uring_modes=()
 
@@ -74,8 +113,18 @@ else
 fi
 
 all_modes=("${modes[@]}" "${uring_modes[@]}")
+pipelined=()
+if [ ${#uring_modes[@]} -gt 0 ]; then
+  pipelined+=("-m multishot -b 16" "-m multishot -d -b 16")
+  pipelined+=("-m multishot --size-classes" "-m multishot -d --size-classes")
+  # Bundles need Linux 6.10.
+  if [ "$(printf '%s\n' 6.10 "$kernel_version" | sort -V | head -1)" == "6.10" ]; then
+    pipelined+=("-m multishot -d --bundle -b 16 --buf-mem-max 1")
+    pipelined+=("-m multishot -d --bundle --size-classes")
+  fi
+fi
 success_count=0
-total_count=${#all_modes[@]}
+total_count=$((${#all_modes[@]} + ${#pipelined[@]}))
 
 for mode in "${all_modes[@]}"; do
   if run_quick_test "$mode"; then
@@ -85,6 +134,14 @@ for mode in "${all_modes[@]}"; do
   sleep 1
 done
 
+for flags in "${pipelined[@]}"; do
+  if run_pipelined_test "$flags"; then
+    success_count=$((success_count + 1))
+  fi
+  echo ""
+  sleep 1
+done
+
 echo "================================================="
 echo "Results: $success_count/$total_count tests passed"
 echo "================================================="
@@ -9,7 +9,14 @@ CONNECTION_CONFIGS=(
     "4:50"     # 4 threads, 50 connections each (200 total)
     "8:25"     # 8 threads, 25 connections each (200 total)
 )
-MODES=("epoll" "uring" "multishot")
+MODES=("epoll" "uring" "multishot" "uring-zc")
+# Number of server reactors (echobench -T), override from the environment.
+SERVER_THREADS=${SERVER_THREADS:-1}
+# Extra echobench options for every run (e.g. "-r" or "-f"), from the environment.
+SERVER_FLAGS=${SERVER_FLAGS:-}
+# io_uring ring profiles to sweep (echobench --ring-profile), e.g.
+# RING_PROFILES="default coop defer". epoll runs once regardless.
+RING_PROFILES=(${RING_PROFILES:-default})
 
 # Output directory
 RESULTS_DIR="results_$(date +%Y%m%d_%H%M%S)"
@@ -35,14 +42,20 @@ run_benchmark() {
     local threads=$2
     local connections=$3
     local msg_size=$4
+    local profile=${5:-default}
 
     local test_name="${mode}_t${threads}_c${connections}_m${msg_size}"
+    local profile_flags=""
+    if [ "$profile" != "default" ]; then
+        test_name="${mode}_p${profile}_t${threads}_c${connections}_m${msg_size}"
+        profile_flags="--ring-profile $profile"
+    fi
     local output_file="$RESULTS_DIR/${test_name}.txt"
 
     echo -n "Running: $test_name ... "
 
     # Start server
-    ./echobench -m "$mode" -p $PORT > "$RESULTS_DIR/${test_name}_server.log" 2>&1 &
+    ./echobench -m "$mode" -p $PORT -T $SERVER_THREADS $SERVER_FLAGS $profile_flags > "$RESULTS_DIR/${test_name}_server.log" 2>&1 &
     local server_pid=$!
 
     # Wait for server to start
@@ -79,19 +92,26 @@ total_tests=0
 passed_tests=0
 
 for mode in "${MODES[@]}"; do
-    for conn_config in "${CONNECTION_CONFIGS[@]}"; do
-        threads=$(echo $conn_config | cut -d: -f1)
-        connections=$(echo $conn_config | cut -d: -f2)
+    profiles=("${RING_PROFILES[@]}")
+    if [ "$mode" = "epoll" ]; then
+        profiles=("default")
+    fi
 
-        for msg_size in "${MESSAGE_SIZES[@]}"; do
-            total_tests=$((total_tests + 1))
+    for profile in "${profiles[@]}"; do
+        for conn_config in "${CONNECTION_CONFIGS[@]}"; do
+            threads=$(echo $conn_config | cut -d: -f1)
+            connections=$(echo $conn_config | cut -d: -f2)
 
-            if run_benchmark "$mode" "$threads" "$connections" "$msg_size"; then
-                passed_tests=$((passed_tests + 1))
-            fi
+            for msg_size in "${MESSAGE_SIZES[@]}"; do
+                total_tests=$((total_tests + 1))
+
+                if run_benchmark "$mode" "$threads" "$connections" "$msg_size" "$profile"; then
+                    passed_tests=$((passed_tests + 1))
+                fi
 
-            # Small delay between tests
-            sleep 2
+                # Small delay between tests
+                sleep 2
+            done
         done
     done
 done
@@ -111,9 +131,12 @@ cat > "$SUMMARY_FILE" << EOF
 === IO_URING Echo Server Benchmark Summary ===
 Date: $(date)
 Duration per test: ${DURATION}s
+Server reactors: ${SERVER_THREADS}
+Server flags: ${SERVER_FLAGS:-none}
 
 Configuration:
 - Modes tested: ${MODES[@]}
+- Ring profiles: ${RING_PROFILES[@]}
 - Message sizes: ${MESSAGE_SIZES[@]} bytes
 - Connection configs: ${CONNECTION_CONFIGS[@]}
 
@@ -187,5 +210,27 @@ for msg_size in "${MESSAGE_SIZES[@]}"; do
     done
 done
 
+# Buffer ring usage of the multishot runs, the cost of whole-buffer recvs at
+# small message sizes (run with SERVER_FLAGS="--buf-inc" to compare).
+echo "=== Buffer Ring Usage (multishot) ===" | tee -a "$SUMMARY_FILE"
+echo "" | tee -a "$SUMMARY_FILE"
+
+for server_log in "$RESULTS_DIR"/multishot_*_server.log; do
+    [ -f "$server_log" ] || continue
+
+    test_name=$(basename "$server_log" _server.log)
+    usage=$(tr '\r' '\n' < "$server_log" | grep "efficiency" | tail -1)
+    efficiency=$(echo "$usage" | grep -oP '[0-9.]+(?=% efficiency)')
+    enobufs=$(echo "$usage" | grep -oP '[0-9]+(?= ENOBUFS)')
+
+    if [ -n "$efficiency" ]; then
+        printf "  %-40s: %6.1f%% efficiency, %8s ENOBUFS (%s/s)\n" \
+               "$test_name" "$efficiency" "$enobufs" \
+               "$(awk "BEGIN { printf \"%.2f\", $enobufs / $DURATION }")" \
+               | tee -a "$SUMMARY_FILE"
+    fi
+done
+echo "" | tee -a "$SUMMARY_FILE"
+
 echo ""
 echo "Full results and logs available in: $RESULTS_DIR"
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""
+Decode an echobench --trace file into a timeline
+"""
+
+import sys
+import errno
+import struct
+import argparse
+
+MAGIC = b'EBTRACE1'
+HEADER = struct.Struct('=8sIIIQ')
+REACTOR = struct.Struct('=II')
+EVENT = struct.Struct('=QiiIHBx')
+
+OPS = ['ACCEPT', 'RECV', 'SEND', 'WAKEUP', 'CQ_OVERFLOW']
+
+# Low io_uring CQE flags.
+CQE_F_MORE = 1 << 1
+CQE_F_NOTIF = 1 << 3
+CQE_F_BUF_MORE = 1 << 4
+
+def read_trace(path):
+    """Return the start time and a list of (ns, reactor, op, fd, res, bytes, flags)."""
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    magic, version, reactors, _entries, start = HEADER.unpack_from(data, 0)
+    if magic != MAGIC or version != 1:
+        raise ValueError(f"{path}: not an echobench trace")
+
+    events = []
+    off = HEADER.size
+    for _ in range(reactors):
+        reactor, count = REACTOR.unpack_from(data, off)
+        off += REACTOR.size
+        for ns, fd, res, nbytes, flags, op in EVENT.iter_unpack(
+                data[off:off + count * EVENT.size]):
+            events.append((ns, reactor, op, fd, res, nbytes, flags))
+        off += count * EVENT.size
+
+    events.sort()
+    return start, events
+
+def describe(op, fd, res, nbytes, flags):
+    """One line of detail for an event, with stalls called out."""
+    name = OPS[op] if op < len(OPS) else f"OP{op}"
+
+    if name == 'WAKEUP':
+        return name, ''
+    if name == 'CQ_OVERFLOW':
+        return name, "completions held back by the kernel  <-- CQ OVERFLOW"
+
+    text = f"fd {fd:<6}"
+    if res < 0:
+        code = errno.errorcode.get(-res, str(-res))
+        text += f" {code}"
+        if -res == errno.ENOBUFS:
+            text += "  <-- OUT OF BUFFERS"
+        elif -res == errno.EAGAIN and name == 'SEND':
+            text += "  <-- SEND BLOCKED"
+    elif name == 'ACCEPT':
+        text += f" -> fd {res}"
+    elif flags & CQE_F_NOTIF:
+        name = 'SEND_NOTIF'
+    else:
+        text += f" {res}" + (f"/{nbytes}" if nbytes else "") + " bytes"
+        if name == 'SEND' and res < nbytes:
+            text += "  <-- PARTIAL SEND"
+
+    if flags & CQE_F_MORE:
+        text += " [more]"
+    if flags & CQE_F_BUF_MORE:
+        text += " [buf_more]"
+    return name, text
+
+def print_timeline(start, events, args):
+    """Print every event in the window, relative to the server's start."""
+    prev = {}
+    for ns, reactor, op, fd, res, nbytes, flags in events:
+        ms = (ns - start) / 1e6
+        if ms < args.start or (args.end is not None and ms > args.end):
+            continue
+
+        name, text = describe(op, fd, res, nbytes, flags)
+        if name == 'WAKEUP' and not args.wakeups:
+            continue
+
+        # Time since the reactor's previous event, to spot stalls.
+        gap = (ns - prev.get(reactor, ns)) / 1e3
+        prev[reactor] = ns
+        mark = "  <-- STALL" if gap >= args.stall else ""
+        line = f"{ms:12.3f} ms  r{reactor:<3} +{gap:9.1f} us  {name:<11} {text}{mark}"
+        print(line.rstrip())
+
+def print_intervals(start, events, args):
+    """Per interval counts, to line up with the server's progress lines."""
+    buckets = {}
+    for ns, _reactor, op, _fd, res, nbytes, flags in events:
+        slot = int((ns - start) / 1e6 // args.interval)
+        b = buckets.setdefault(slot, {'recv': 0, 'send': 0, 'bytes': 0,
+                                      'partial': 0, 'enobufs': 0,
+                                      'errors': 0, 'overflow': 0})
+        name = OPS[op] if op < len(OPS) else ''
+        if name == 'RECV':
+            if res > 0:
+                b['recv'] += 1
+                b['bytes'] += res
+            elif -res == errno.ENOBUFS:
+                b['enobufs'] += 1
+            elif res < 0:
+                b['errors'] += 1
+        elif name == 'SEND' and not flags & CQE_F_NOTIF:
+            b['send'] += 1
+            if res < 0 and -res != errno.EAGAIN:
+                b['errors'] += 1
+            elif res < nbytes:
+                b['partial'] += 1
+        elif name == 'CQ_OVERFLOW':
+            b['overflow'] += 1
+
+    print(f"{'Time (ms)':>12} {'Recvs':>10} {'Sends':>10} {'MB':>10} "
+          f"{'Partial':>8} {'ENOBUFS':>8} {'Errors':>8} {'Overflow':>8}")
+    for slot in sorted(buckets):
+        b = buckets[slot]
+        print(f"{slot * args.interval:12.0f} {b['recv']:10} {b['send']:10} "
+              f"{b['bytes'] / (1024 * 1024):10.2f} {b['partial']:8} "
+              f"{b['enobufs']:8} {b['errors']:8} {b['overflow']:8}")
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode an echobench --trace file')
+    parser.add_argument('trace', help='Trace file written by echobench --trace')
+    parser.add_argument('--start', type=float, default=0,
+                        help='Only show events from this many ms after start')
+    parser.add_argument('--end', type=float, default=None,
+                        help='Only show events up to this many ms after start')
+    parser.add_argument('--stall', type=float, default=1000,
+                        help='Flag gaps in a reactor of at least this many us (default: 1000)')
+    parser.add_argument('--wakeups', action='store_true',
+                        help='Show reactor wakeups too')
+    parser.add_argument('--interval', type=float, default=None,
+                        help='Print per-interval counts (ms) instead of the timeline')
+
+    args = parser.parse_args()
+
+    try:
+        start, events = read_trace(args.trace)
+    except (OSError, ValueError, struct.error) as e:
+        print(f"Error reading {args.trace}: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    if args.interval:
+        print_intervals(start, events, args)
+    else:
+        print_timeline(start, events, args)
+
+if __name__ == '__main__':
+    main()